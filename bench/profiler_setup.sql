@@ -0,0 +1,51 @@
+--
+-- Functions used by benchmarks of plpgsql_check profiler
+--
+--   psql -v nfuncs=1000 -f profiler_setup.sql
+--
+CREATE EXTENSION IF NOT EXISTS plpgsql_check;
+
+CREATE OR REPLACE FUNCTION bench_inner(a int)
+RETURNS int AS $$
+BEGIN
+  RETURN a + 1;
+END;
+$$ LANGUAGE plpgsql;
+
+-- statements executed in loop, nested calls and one query
+CREATE OR REPLACE FUNCTION bench_outer(n int)
+RETURNS int AS $$
+DECLARE s int := 0;
+BEGIN
+  FOR i IN 1..n
+  LOOP
+    s := s + i;
+    IF i % 10 = 0 THEN
+      s := bench_inner(s);
+    END IF;
+  END LOOP;
+  PERFORM count(*) FROM pg_class WHERE oid = 'pg_class'::regclass;
+  RETURN s;
+END;
+$$ LANGUAGE plpgsql;
+
+-- many small functions, so profiles are created in all partitions
+SELECT set_config('bench.nfuncs', :'nfuncs', false);
+
+DO $$
+BEGIN
+  FOR i IN 1..current_setting('bench.nfuncs')::int
+  LOOP
+    EXECUTE format($f$
+      CREATE OR REPLACE FUNCTION bench_f_%s(a int)
+      RETURNS int AS $b$
+      BEGIN
+        IF a > 0 THEN
+          RETURN bench_inner(a);
+        END IF;
+        RETURN a;
+      END;
+      $b$ LANGUAGE plpgsql$f$, i);
+  END LOOP;
+END;
+$$;
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Benchmark of overhead of plpgsql_check profiler and stress test of
+# concurrent access to shared profiles. It expects running server with
+# plpgsql_check in shared_preload_libraries. The connection is specified
+# by environment variables (PGDATABASE, PGHOST, ...).
+#
+#   bench/run.sh [clients] [seconds]
+#
+
+set -e
+
+cd "$(dirname "$0")"
+
+CLIENTS=${1:-8}
+TIME=${2:-30}
+NFUNCS=${NFUNCS:-1000}
+
+psql -X -q -v ON_ERROR_STOP=1 -v nfuncs="$NFUNCS" -f profiler_setup.sql > /dev/null
+
+# run [name] [PGOPTIONS] [pgbench scripts]
+run()
+{
+	name=$1
+	options=$2
+	shift 2
+
+	psql -X -q -c "SELECT plpgsql_profiler_reset_all()" > /dev/null
+
+	if ! out=$(PGOPTIONS="$options" pgbench -n -M simple -c "$CLIENTS" -j "$CLIENTS" -T "$TIME" -D nfuncs="$NFUNCS" "$@" 2>&1)
+	then
+		echo "$out"
+		echo "$name: pgbench failed"
+		exit 1
+	fi
+
+	printf "%-32s %s\n" "$name" "$(echo "$out" | sed -n 's/^tps = \([0-9.]*\).*/\1/p' | head -n 1)"
+}
+
+echo "clients: $CLIENTS, time: $TIME s"
+echo "test                             tps"
+
+P="-c plpgsql_check.profiler=on"
+
+run "profiler off"               ""                                                    -f profiler_call.pgbench
+run "profiler on"                "$P"                                                  -f profiler_call.pgbench
+run "profiler on, tsc timer"     "$P -c plpgsql_check.profiler_timer=tsc"              -f profiler_call.pgbench
+run "profiler on, flush 100"     "$P -c plpgsql_check.profiler_flush_calls=100"        -f profiler_call.pgbench
+run "profiler on, sample 0.1"    "$P -c plpgsql_check.profiler_sample_rate=0.1"        -f profiler_call.pgbench
+run "profiler on, timing off"    "$P -c plpgsql_check.profiler_timing=off"             -f profiler_call.pgbench
+run "profiler on, buffers"       "$P -c plpgsql_check.profiler_buffers=on"             -f profiler_call.pgbench
+
+# new profiles in all partitions with concurrent resets and reading
+run "stress off"                 ""                                                    -f profiler_stress.pgbench@9 -f profiler_stress_reset.pgbench@1
+run "stress"                     "$P"                                                  -f profiler_stress.pgbench@9 -f profiler_stress_reset.pgbench@1
+run "stress, flush 100"          "$P -c plpgsql_check.profiler_flush_calls=100"        -f profiler_stress.pgbench@9 -f profiler_stress_reset.pgbench@1
+
+# the profiles should be consistent after stress test
+psql -X -q -v ON_ERROR_STOP=1 -c "SELECT count(*) AS profiled_functions FROM plpgsql_profiler_functions_all()"
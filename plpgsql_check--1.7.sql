@@ -183,6 +183,12 @@ RETURNS TABLE(lineno int,
               total_time double precision,
               avg_time double precision,
               max_time double precision[],
+              self_time double precision,
+              self_max_time double precision[],
+              p50_time double precision[],
+              p90_time double precision[],
+              p99_time double precision[],
+              p999_time double precision[],
               processed_rows int8[],
               source text)
 AS $$
@@ -200,6 +206,12 @@ RETURNS TABLE(lineno int,
               total_time double precision,
               avg_time double precision,
               max_time double precision[],
+              self_time double precision,
+              self_max_time double precision[],
+              p50_time double precision[],
+              p90_time double precision[],
+              p99_time double precision[],
+              p999_time double precision[],
               processed_rows int8[],
               source text)
 AS $$
@@ -217,6 +229,12 @@ RETURNS TABLE(lineno int,
               total_time double precision,
               avg_time double precision,
               max_time double precision[],
+              self_time double precision,
+              self_max_time double precision[],
+              p50_time double precision[],
+              p90_time double precision[],
+              p99_time double precision[],
+              p999_time double precision[],
               processed_rows int8[],
               source text)
 AS 'MODULE_PATHNAME','plpgsql_profiler_function_tb'
@@ -232,7 +250,20 @@ RETURNS TABLE(stmtid int,
               total_time double precision,
               avg_time double precision,
               max_time double precision,
+              self_time double precision,
+              self_max_time double precision,
+              planning_time double precision,
+              execution_time double precision,
+              p50_time double precision,
+              p90_time double precision,
+              p99_time double precision,
+              p999_time double precision,
               processed_rows int8,
+              shared_blks_hit int8,
+              shared_blks_read int8,
+              shared_blks_dirtied int8,
+              temp_blks_written int8,
+              queryid int8,
               stmtname text)
 AS $$
 BEGIN
@@ -251,11 +282,90 @@ RETURNS TABLE(stmtid int,
               total_time double precision,
               avg_time double precision,
               max_time double precision,
+              self_time double precision,
+              self_max_time double precision,
+              planning_time double precision,
+              execution_time double precision,
+              p50_time double precision,
+              p90_time double precision,
+              p99_time double precision,
+              p999_time double precision,
               processed_rows int8,
+              shared_blks_hit int8,
+              shared_blks_read int8,
+              shared_blks_dirtied int8,
+              temp_blks_written int8,
+              queryid int8,
               stmtname text)
 AS 'MODULE_PATHNAME','plpgsql_profiler_function_statements_tb'
 LANGUAGE C STRICT;
 
+CREATE FUNCTION plpgsql_profiler_functions_all()
+RETURNS TABLE(funcoid regprocedure,
+              exec_count int8,
+              total_time double precision,
+              avg_time double precision,
+              stddev_time double precision,
+              min_time double precision,
+              max_time double precision,
+              p50_time double precision,
+              p90_time double precision,
+              p99_time double precision,
+              p999_time double precision,
+              calls_per_sec double precision,
+              stats_since timestamptz)
+AS 'MODULE_PATHNAME','plpgsql_profiler_functions_all_tb'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION plpgsql_profiler_top_statements(n int DEFAULT 10, order_by text DEFAULT 'total_time')
+RETURNS TABLE(funcoid regprocedure,
+              stmtid int,
+              lineno int,
+              exec_stmts int8,
+              total_time double precision,
+              avg_time double precision,
+              max_time double precision,
+              processed_rows int8)
+AS 'MODULE_PATHNAME','plpgsql_profiler_top_statements_tb'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION plpgsql_profiler_call_graph()
+RETURNS TABLE(caller regprocedure,
+              caller_stmtid int,
+              caller_lineno int,
+              callee regprocedure,
+              calls int8,
+              total_time double precision,
+              avg_time double precision,
+              self_time double precision)
+AS 'MODULE_PATHNAME','plpgsql_profiler_call_graph_tb'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION plpgsql_profiler_flamegraph(counter text DEFAULT 'time')
+RETURNS SETOF text
+AS 'MODULE_PATHNAME','plpgsql_profiler_flamegraph_tb'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION __plpgsql_profiler_activity()
+RETURNS TABLE(pid int,
+              dbid oid,
+              funcoid oid,
+              lineno int,
+              depth int)
+AS 'MODULE_PATHNAME','plpgsql_profiler_activity_tb'
+LANGUAGE C STRICT;
+
+CREATE VIEW plpgsql_profiler_activity AS
+  SELECT a.pid,
+         a.dbid,
+         CASE WHEN a.dbid = d.oid THEN a.funcoid::regprocedure END AS func,
+         a.funcoid,
+         a.lineno,
+         a.depth
+    FROM @extschema@.__plpgsql_profiler_activity() a,
+         pg_catalog.pg_database d
+   WHERE d.datname = pg_catalog.current_database();
+
 CREATE FUNCTION __plpgsql_profiler_reset_all()
 RETURNS void AS 'MODULE_PATHNAME','plpgsql_profiler_reset_all'
 LANGUAGE C STRICT;
@@ -81,6 +81,137 @@ select plpgsql_profiler_reset_all();
 
 select lineno, stmt_lineno, exec_stmts, source from plpgsql_profiler_function_tb('f1()');
 
+-- only counters are collected
+set plpgsql_check.profiler_timing to off;
+
+select f1();
+
+select lineno, exec_stmts, total_time, p50_time from plpgsql_profiler_function_tb('f1()') where exec_stmts > 0;
+
+set plpgsql_check.profiler_timing to on;
+
+select plpgsql_profiler_reset_all();
+
+-- percentiles of times of statements
+select f1();
+
+select lineno, exec_stmts, p50_time >= 0 as p50, p999_time >= p50_time as p999 from plpgsql_profiler_function_statements_tb('f1()') where exec_stmts > 0;
+
+select funcoid, exec_count, min_time <= max_time as minmax, p50_time >= 0 as p50 from plpgsql_profiler_functions_all();
+
+select funcoid, stmtid, lineno, exec_stmts from plpgsql_profiler_top_statements(10, 'exec_count');
+
+select plpgsql_profiler_reset_all();
+
+-- call graph of nested calls
+create function f2()
+returns void as $$
+begin
+  perform f1();
+  perform f1();
+end;
+$$ language plpgsql;
+
+select f2();
+
+select caller, caller_lineno, callee, calls, self_time <= total_time as self from plpgsql_profiler_call_graph() order by caller_lineno;
+
+select stack from plpgsql_profiler_flamegraph('exec_count') stack order by stack collate "C";
+
+select stmtid, lineno, exec_stmts, self_time <= total_time as self, self_max_time <= max_time as self_max from plpgsql_profiler_function_statements_tb('f2()');
+
+set plpgsql_check.profiler_sql_timing to on;
+
+select f2();
+
+select stmtid, lineno, exec_stmts, planning_time + execution_time <= total_time as sql_time from plpgsql_profiler_function_statements_tb('f2()');
+
+-- the time of nested profiled calls is not part of planning and execution time
+create function f3()
+returns void as $$
+begin
+  perform f1() from generate_series(1,2);
+end;
+$$ language plpgsql;
+
+select f3();
+
+select stmtid, lineno, exec_stmts, planning_time + execution_time <= self_time as sql_self_time from plpgsql_profiler_function_statements_tb('f3()');
+
+-- queryid is known only when some extension calculates it (like pg_stat_statements)
+select stmtid, lineno, queryid is null as no_queryid from plpgsql_profiler_function_statements_tb('f3()');
+
+-- queryid is read from prepared plan, so simple expressions can have queryid too
+select stmtid, lineno, queryid is null as no_queryid from plpgsql_profiler_function_statements_tb('f2()');
+
+drop function f3();
+
+set plpgsql_check.profiler_sql_timing to off;
+
+set plpgsql_check.profiler_buffers to on;
+
+select f2();
+
+select stmtid, lineno, exec_stmts, shared_blks_hit >= 0 and shared_blks_read >= 0 and shared_blks_dirtied >= 0 and temp_blks_written >= 0 as buffers from plpgsql_profiler_function_statements_tb('f2()');
+
+set plpgsql_check.profiler_buffers to off;
+
+-- current backend doesn't execute any profiled function now
+select count(*) from plpgsql_profiler_activity where pid = pg_backend_pid();
+
+-- nested calls inherit sampling decision of outermost call, so the edges
+-- of call graph and the calls of called function are sampled together
+select plpgsql_profiler_reset_all();
+
+set plpgsql_check.profiler_sample_rate to 0.5;
+
+select count(*) from generate_series(1,20) g where f2() is not null;
+
+select coalesce((select sum(calls) from plpgsql_profiler_call_graph() where callee = 'f1()'::regprocedure), 0) =
+       coalesce((select exec_count from plpgsql_profiler_functions_all() where funcoid = 'f1()'::regprocedure), 0) as same_calls,
+       coalesce((select exec_count from plpgsql_profiler_functions_all() where funcoid = 'f1()'::regprocedure), 0) =
+       2 * coalesce((select exec_count from plpgsql_profiler_functions_all() where funcoid = 'f2()'::regprocedure), 0) as same_sampling;
+
+set plpgsql_check.profiler_sample_rate to 1.0;
+
+-- frames of calls broken by an error are released, so the next call
+-- is assigned to right caller
+select plpgsql_profiler_reset_all();
+
+create function f4()
+returns void as $$
+begin
+  perform f1();
+  raise exception 'stop';
+end;
+$$ language plpgsql;
+
+create function f5()
+returns void as $$
+begin
+  begin
+    perform f4();
+  exception when others then
+    null;
+  end;
+  perform f1();
+end;
+$$ language plpgsql;
+
+select f5();
+
+select caller, caller_lineno, callee, calls from plpgsql_profiler_call_graph() order by caller_lineno;
+
+select count(*) from plpgsql_profiler_activity where pid = pg_backend_pid();
+
+drop function f5();
+
+drop function f4();
+
+select plpgsql_profiler_reset_all();
+
+drop function f2();
+
 drop function f1();
 
 set plpgsql_check.profiler to off;
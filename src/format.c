@@ -71,7 +71,7 @@ static void put_error_tabular(plpgsql_check_result_info *ri, PLpgSQL_execstate *
  * columns of plpgsql_profiler_function_tb result
  *
  */
-#define Natts_profiler					9
+#define Natts_profiler					15
 
 #define Anum_profiler_lineno			0
 #define Anum_profiler_stmt_lineno		1
@@ -80,14 +80,20 @@ static void put_error_tabular(plpgsql_check_result_info *ri, PLpgSQL_execstate *
 #define Anum_profiler_total_time		4
 #define Anum_profiler_avg_time			5
 #define Anum_profiler_max_time			6
-#define Anum_profiler_processed_rows	7
-#define Anum_profiler_source			8
+#define Anum_profiler_self_time			7
+#define Anum_profiler_self_max_time		8
+#define Anum_profiler_p50_time			9
+#define Anum_profiler_p90_time			10
+#define Anum_profiler_p99_time			11
+#define Anum_profiler_p999_time			12
+#define Anum_profiler_processed_rows	13
+#define Anum_profiler_source			14
 
 /*
  * columns of plpgsql_profiler_function_statements_tb result
  *
  */
-#define Natts_profiler_statements					11
+#define Natts_profiler_statements					24
 
 #define Anum_profiler_statements_stmtid				0
 #define Anum_profiler_statements_parent_stmtid		1
@@ -98,8 +104,81 @@ static void put_error_tabular(plpgsql_check_result_info *ri, PLpgSQL_execstate *
 #define Anum_profiler_statements_total_time			6
 #define Anum_profiler_statements_avg_time			7
 #define Anum_profiler_statements_max_time			8
-#define Anum_profiler_statements_processed_rows		9
-#define Anum_profiler_statements_stmtname			10
+#define Anum_profiler_statements_self_time			9
+#define Anum_profiler_statements_self_max_time		10
+#define Anum_profiler_statements_planning_time		11
+#define Anum_profiler_statements_execution_time		12
+#define Anum_profiler_statements_p50_time			13
+#define Anum_profiler_statements_p90_time			14
+#define Anum_profiler_statements_p99_time			15
+#define Anum_profiler_statements_p999_time			16
+#define Anum_profiler_statements_processed_rows		17
+#define Anum_profiler_statements_shared_blks_hit	18
+#define Anum_profiler_statements_shared_blks_read	19
+#define Anum_profiler_statements_shared_blks_dirtied	20
+#define Anum_profiler_statements_temp_blks_written	21
+#define Anum_profiler_statements_queryid			22
+#define Anum_profiler_statements_stmtname			23
+
+/*
+ * columns of plpgsql_profiler_functions_all result
+ *
+ */
+#define Natts_profiler_functions_all				13
+
+#define Anum_profiler_functions_all_funcoid			0
+#define Anum_profiler_functions_all_exec_count		1
+#define Anum_profiler_functions_all_total_time		2
+#define Anum_profiler_functions_all_avg_time		3
+#define Anum_profiler_functions_all_stddev_time		4
+#define Anum_profiler_functions_all_min_time		5
+#define Anum_profiler_functions_all_max_time		6
+#define Anum_profiler_functions_all_p50_time		7
+#define Anum_profiler_functions_all_p90_time		8
+#define Anum_profiler_functions_all_p99_time		9
+#define Anum_profiler_functions_all_p999_time		10
+#define Anum_profiler_functions_all_calls_per_sec	11
+#define Anum_profiler_functions_all_stats_since		12
+
+/*
+ * columns of plpgsql_profiler_top_statements result
+ *
+ */
+#define Natts_profiler_top_statements				8
+
+#define Anum_profiler_top_statements_funcoid		0
+#define Anum_profiler_top_statements_stmtid			1
+#define Anum_profiler_top_statements_lineno			2
+#define Anum_profiler_top_statements_exec_stmts		3
+#define Anum_profiler_top_statements_total_time		4
+#define Anum_profiler_top_statements_avg_time		5
+#define Anum_profiler_top_statements_max_time		6
+#define Anum_profiler_top_statements_processed_rows	7
+
+/*
+ * columns of plpgsql_profiler_call_graph result
+ */
+#define Natts_profiler_call_graph					8
+
+#define Anum_profiler_call_graph_caller				0
+#define Anum_profiler_call_graph_caller_stmtid		1
+#define Anum_profiler_call_graph_caller_lineno		2
+#define Anum_profiler_call_graph_callee				3
+#define Anum_profiler_call_graph_calls				4
+#define Anum_profiler_call_graph_total_time			5
+#define Anum_profiler_call_graph_avg_time			6
+#define Anum_profiler_call_graph_self_time			7
+
+/*
+ * columns of plpgsql_profiler_activity result
+ */
+#define Natts_profiler_activity						5
+
+#define Anum_profiler_activity_pid					0
+#define Anum_profiler_activity_dbid					1
+#define Anum_profiler_activity_funcoid				2
+#define Anum_profiler_activity_lineno				3
+#define Anum_profiler_activity_depth				4
 
 
 #define SET_RESULT_NULL(anum) \
@@ -180,6 +259,7 @@ plpgsql_check_init_ri(plpgsql_check_result_info *ri,
 		case PLPGSQL_CHECK_FORMAT_TEXT:
 		case PLPGSQL_CHECK_FORMAT_XML:
 		case PLPGSQL_CHECK_FORMAT_JSON:
+		case PLPGSQL_SHOW_PROFILE_FLAMEGRAPH_TEXT:
 			natts = 1;
 			break;
 		case PLPGSQL_CHECK_FORMAT_TABULAR:
@@ -194,6 +274,18 @@ plpgsql_check_init_ri(plpgsql_check_result_info *ri,
 		case PLPGSQL_SHOW_PROFILE_STATEMENTS_TABULAR:
 			natts = Natts_profiler_statements;
 			break;
+		case PLPGSQL_SHOW_PROFILE_FUNCTIONS_ALL_TABULAR:
+			natts = Natts_profiler_functions_all;
+			break;
+		case PLPGSQL_SHOW_PROFILE_TOP_STATEMENTS_TABULAR:
+			natts = Natts_profiler_top_statements;
+			break;
+		case PLPGSQL_SHOW_PROFILE_CALL_GRAPH_TABULAR:
+			natts = Natts_profiler_call_graph;
+			break;
+		case PLPGSQL_SHOW_PROFILE_ACTIVITY_TABULAR:
+			natts = Natts_profiler_activity;
+			break;
 		default:
 			elog(ERROR, "unknown format %d", format);
 	}
@@ -819,6 +911,8 @@ plpgsql_check_put_dependency(plpgsql_check_result_info *ri,
 /*
  * Store one output row of profiler to result tuplestore
  *
+ * percentile_time_arrays are arrays of p50, p90, p99 and p999
+ * times of statements on the row.
  */
 void
 plpgsql_check_put_profile(plpgsql_check_result_info *ri,
@@ -828,6 +922,9 @@ plpgsql_check_put_profile(plpgsql_check_result_info *ri,
 						  int exec_count,
 						  int64 us_total,
 						  Datum max_time_array,
+						  int64 us_self_total,
+						  Datum self_max_time_array,
+						  Datum *percentile_time_arrays,
 						  Datum processed_rows_array,
 						  char *source_row)
 {
@@ -842,6 +939,12 @@ plpgsql_check_put_profile(plpgsql_check_result_info *ri,
 	SET_RESULT_NULL(Anum_profiler_total_time);
 	SET_RESULT_NULL(Anum_profiler_avg_time);
 	SET_RESULT_NULL(Anum_profiler_max_time);
+	SET_RESULT_NULL(Anum_profiler_self_time);
+	SET_RESULT_NULL(Anum_profiler_self_max_time);
+	SET_RESULT_NULL(Anum_profiler_p50_time);
+	SET_RESULT_NULL(Anum_profiler_p90_time);
+	SET_RESULT_NULL(Anum_profiler_p99_time);
+	SET_RESULT_NULL(Anum_profiler_p999_time);
 	SET_RESULT_NULL(Anum_profiler_processed_rows);
 	SET_RESULT_NULL(Anum_profiler_source);
 	SET_RESULT_NULL(Anum_profiler_cmds_on_row);
@@ -857,6 +960,12 @@ plpgsql_check_put_profile(plpgsql_check_result_info *ri,
 		SET_RESULT_FLOAT8(Anum_profiler_total_time, us_total / 1000.0);
 		SET_RESULT_FLOAT8(Anum_profiler_avg_time, ceil(((float8) us_total) / exec_count) / 1000.0);
 		SET_RESULT(Anum_profiler_max_time, max_time_array);
+		SET_RESULT_FLOAT8(Anum_profiler_self_time, us_self_total / 1000.0);
+		SET_RESULT(Anum_profiler_self_max_time, self_max_time_array);
+		SET_RESULT(Anum_profiler_p50_time, percentile_time_arrays[0]);
+		SET_RESULT(Anum_profiler_p90_time, percentile_time_arrays[1]);
+		SET_RESULT(Anum_profiler_p99_time, percentile_time_arrays[2]);
+		SET_RESULT(Anum_profiler_p999_time, percentile_time_arrays[3]);
 		SET_RESULT(Anum_profiler_processed_rows, processed_rows_array);
 	}
 
@@ -867,6 +976,8 @@ plpgsql_check_put_profile(plpgsql_check_result_info *ri,
  * Store one output row of profiler to result tuplestore in statement 
  * oriented format
  *
+ * percentile_times are p50, p90, p99 and p999 times of statement.
+ * Negative value means unknown value (timing was not enabled).
  */
 void
 plpgsql_check_put_profile_statement(plpgsql_check_result_info *ri,
@@ -878,11 +989,22 @@ plpgsql_check_put_profile_statement(plpgsql_check_result_info *ri,
 									int64 exec_stmts,
 									double total_time,
 									double max_time,
+									double self_time,
+									double self_max_time,
+									double planning_time,
+									double execution_time,
+									double *percentile_times,
 									int64 processed_rows,
+									int64 shared_blks_hit,
+									int64 shared_blks_read,
+									int64 shared_blks_dirtied,
+									int64 temp_blks_written,
+									uint64 queryid,
 									char *stmtname)
 {
 	Datum	values[Natts_profiler_statements];
 	bool	nulls[Natts_profiler_statements];
+	int		i;
 
 	Assert(ri->tuple_store);
 	Assert(ri->tupdesc);
@@ -896,11 +1018,32 @@ plpgsql_check_put_profile_statement(plpgsql_check_result_info *ri,
 	SET_RESULT_INT32(Anum_profiler_statements_lineno, lineno);
 	SET_RESULT_INT64(Anum_profiler_statements_exec_stmts, exec_stmts);
 	SET_RESULT_INT64(Anum_profiler_statements_processed_rows, processed_rows);
-	SET_RESULT_FLOAT8(Anum_profiler_statements_total_time, total_time / 1000.0);
+	SET_RESULT_INT64(Anum_profiler_statements_shared_blks_hit, shared_blks_hit);
+	SET_RESULT_INT64(Anum_profiler_statements_shared_blks_read, shared_blks_read);
+	SET_RESULT_INT64(Anum_profiler_statements_shared_blks_dirtied, shared_blks_dirtied);
+	SET_RESULT_INT64(Anum_profiler_statements_temp_blks_written, temp_blks_written);
+
+	/* queryid is known only when some extension calculates it */
+	if (queryid != 0)
+		SET_RESULT_INT64(Anum_profiler_statements_queryid, (int64) queryid);
+	else
+		SET_RESULT_NULL(Anum_profiler_statements_queryid);
 	SET_RESULT_FLOAT8(Anum_profiler_statements_total_time, total_time / 1000.0);
 	SET_RESULT_FLOAT8(Anum_profiler_statements_max_time, max_time / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_statements_self_time, self_time / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_statements_self_max_time, self_max_time / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_statements_planning_time, planning_time / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_statements_execution_time, execution_time / 1000.0);
 	SET_RESULT_TEXT(Anum_profiler_statements_stmtname, stmtname);
 
+	for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; i++)
+	{
+		if (percentile_times[i] >= 0.0)
+			SET_RESULT_FLOAT8(Anum_profiler_statements_p50_time + i, percentile_times[i] / 1000.0);
+		else
+			SET_RESULT_NULL(Anum_profiler_statements_p50_time + i);
+	}
+
 	if (parent_note)
 		SET_RESULT_TEXT(Anum_profiler_statements_parent_note, parent_note);
 	else
@@ -919,3 +1062,195 @@ plpgsql_check_put_profile_statement(plpgsql_check_result_info *ri,
 
 	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
 }
+
+/*
+ * Store one output row of plpgsql_profiler_functions_all to result
+ * tuplestore. The times are in microseconds, negative value means
+ * unknown value (timing was not enabled).
+ *
+ */
+void
+plpgsql_check_put_profiler_functions_all(plpgsql_check_result_info *ri,
+										 Oid funcoid,
+										 int64 exec_count,
+										 double total_time,
+										 double avg_time,
+										 double stddev_time,
+										 double min_time,
+										 double max_time,
+										 double *percentile_times,
+										 double calls_per_sec,
+										 TimestampTz stats_since)
+{
+	Datum	values[Natts_profiler_functions_all];
+	bool	nulls[Natts_profiler_functions_all];
+	int		i;
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_OID(Anum_profiler_functions_all_funcoid, funcoid);
+	SET_RESULT_INT64(Anum_profiler_functions_all_exec_count, exec_count);
+	SET_RESULT_FLOAT8(Anum_profiler_functions_all_total_time, total_time / 1000.0);
+	SET_RESULT(Anum_profiler_functions_all_stats_since, TimestampTzGetDatum(stats_since));
+
+	if (avg_time >= 0.0)
+	{
+		SET_RESULT_FLOAT8(Anum_profiler_functions_all_avg_time, avg_time / 1000.0);
+		SET_RESULT_FLOAT8(Anum_profiler_functions_all_stddev_time, stddev_time / 1000.0);
+		SET_RESULT_FLOAT8(Anum_profiler_functions_all_min_time, min_time / 1000.0);
+		SET_RESULT_FLOAT8(Anum_profiler_functions_all_max_time, max_time / 1000.0);
+	}
+	else
+	{
+		SET_RESULT_NULL(Anum_profiler_functions_all_avg_time);
+		SET_RESULT_NULL(Anum_profiler_functions_all_stddev_time);
+		SET_RESULT_NULL(Anum_profiler_functions_all_min_time);
+		SET_RESULT_NULL(Anum_profiler_functions_all_max_time);
+	}
+
+	for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; i++)
+	{
+		if (percentile_times[i] >= 0.0)
+			SET_RESULT_FLOAT8(Anum_profiler_functions_all_p50_time + i, percentile_times[i] / 1000.0);
+		else
+			SET_RESULT_NULL(Anum_profiler_functions_all_p50_time + i);
+	}
+
+	if (calls_per_sec >= 0.0)
+		SET_RESULT_FLOAT8(Anum_profiler_functions_all_calls_per_sec, calls_per_sec);
+	else
+		SET_RESULT_NULL(Anum_profiler_functions_all_calls_per_sec);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store one output row of plpgsql_profiler_top_statements to result
+ * tuplestore.
+ *
+ */
+void
+plpgsql_check_put_profiler_top_statement(plpgsql_check_result_info *ri,
+										 Oid funcoid,
+										 int stmtid,
+										 int lineno,
+										 int64 exec_count,
+										 int64 us_total,
+										 int64 us_max,
+										 int64 processed_rows)
+{
+	Datum	values[Natts_profiler_top_statements];
+	bool	nulls[Natts_profiler_top_statements];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_OID(Anum_profiler_top_statements_funcoid, funcoid);
+	SET_RESULT_INT32(Anum_profiler_top_statements_stmtid, stmtid);
+	SET_RESULT_INT32(Anum_profiler_top_statements_lineno, lineno);
+	SET_RESULT_INT64(Anum_profiler_top_statements_exec_stmts, exec_count);
+	SET_RESULT_FLOAT8(Anum_profiler_top_statements_total_time, us_total / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_top_statements_avg_time, ceil(((float8) us_total) / exec_count) / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_top_statements_max_time, us_max / 1000.0);
+	SET_RESULT_INT64(Anum_profiler_top_statements_processed_rows, processed_rows);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store one edge of call graph to result. The negative lineno
+ * means unknown line (the profile of caller was removed).
+ */
+void
+plpgsql_check_put_profiler_call_graph_edge(plpgsql_check_result_info *ri,
+										   Oid caller_oid,
+										   int caller_stmtid,
+										   int caller_lineno,
+										   Oid callee_oid,
+										   int64 calls,
+										   int64 us_total,
+										   int64 us_self)
+{
+	Datum	values[Natts_profiler_call_graph];
+	bool	nulls[Natts_profiler_call_graph];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_OID(Anum_profiler_call_graph_caller, caller_oid);
+	SET_RESULT_INT32(Anum_profiler_call_graph_caller_stmtid, caller_stmtid);
+
+	if (caller_lineno >= 0)
+		SET_RESULT_INT32(Anum_profiler_call_graph_caller_lineno, caller_lineno);
+	else
+		SET_RESULT_NULL(Anum_profiler_call_graph_caller_lineno);
+
+	SET_RESULT_OID(Anum_profiler_call_graph_callee, callee_oid);
+	SET_RESULT_INT64(Anum_profiler_call_graph_calls, calls);
+	SET_RESULT_FLOAT8(Anum_profiler_call_graph_total_time, us_total / 1000.0);
+
+	if (calls > 0)
+		SET_RESULT_FLOAT8(Anum_profiler_call_graph_avg_time, ceil(((float8) us_total) / calls) / 1000.0);
+	else
+		SET_RESULT_NULL(Anum_profiler_call_graph_avg_time);
+
+	SET_RESULT_FLOAT8(Anum_profiler_call_graph_self_time, us_self / 1000.0);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store one stack of flame graph (in collapsed format) to result
+ */
+void
+plpgsql_check_put_profiler_flamegraph_line(plpgsql_check_result_info *ri,
+										   const char *line,
+										   int len)
+{
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	put_text_line(ri, line, len);
+}
+
+/*
+ * Store currently executed statement of one backend to result
+ */
+void
+plpgsql_check_put_profiler_activity(plpgsql_check_result_info *ri,
+									int pid,
+									Oid dbid,
+									Oid funcoid,
+									int lineno,
+									int depth)
+{
+	Datum	values[Natts_profiler_activity];
+	bool	nulls[Natts_profiler_activity];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_INT32(Anum_profiler_activity_pid, pid);
+	SET_RESULT_OID(Anum_profiler_activity_dbid, dbid);
+
+	/* the function of backend of other role can be hidden */
+	if (OidIsValid(funcoid))
+	{
+		SET_RESULT_OID(Anum_profiler_activity_funcoid, funcoid);
+		SET_RESULT_INT32(Anum_profiler_activity_depth, depth);
+	}
+	else
+	{
+		SET_RESULT_NULL(Anum_profiler_activity_funcoid);
+		SET_RESULT_NULL(Anum_profiler_activity_depth);
+	}
+
+	/* the statements of declarations have not line */
+	if (lineno > 0)
+		SET_RESULT_INT32(Anum_profiler_activity_lineno, lineno);
+	else
+		SET_RESULT_NULL(Anum_profiler_activity_lineno);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
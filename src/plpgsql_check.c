@@ -53,11 +53,19 @@ static const struct config_enum_entry plpgsql_check_mode_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry plpgsql_check_profiler_timer_options[] = {
+	{"clock", PLPGSQL_CHECK_PROFILER_TIMER_CLOCK, false},
+	{"tsc", PLPGSQL_CHECK_PROFILER_TIMER_TSC, false},
+	{NULL, 0, false}
+};
+
 
 void			_PG_init(void);
 void			_PG_fini(void);
 
 shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+planner_hook_type prev_planner_hook = NULL;
+ExecutorRun_hook_type prev_ExecutorRun_hook = NULL;
 
 
 /*
@@ -129,22 +137,133 @@ _PG_init(void)
 					    PGC_USERSET, 0,
 					    NULL, NULL, NULL);
 
+	DefineCustomIntVariable("plpgsql_check.profiler_flush_calls",
+					    "number of calls accumulated in session before profiles are flushed to shared memory",
+					    "Zero means the profile is merged to shared memory after every call.",
+					    &plpgsql_check_profiler_flush_calls,
+					    0,
+					    0, INT_MAX,
+					    PGC_USERSET, 0,
+					    NULL, NULL, NULL);
+
+	DefineCustomIntVariable("plpgsql_check.profiler_flush_interval",
+					    "maximal time of accumulation of profiles in session before flush to shared memory",
+					    "Zero means no time limit.",
+					    &plpgsql_check_profiler_flush_interval,
+					    0,
+					    0, INT_MAX,
+					    PGC_USERSET, GUC_UNIT_MS,
+					    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.profiler_timing",
+						    "when is false, then profiler collects only execution counters and processed rows",
+						    NULL,
+						    &plpgsql_check_profiler_timing,
+						    true,
+						    PGC_USERSET, 0,
+						    NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("plpgsql_check.profiler_timer",
+						    "choose a timer used by profiler",
+						    "The tsc timer is cheaper, but it is available only on x86_64 with invariant time stamp counter.",
+						    &plpgsql_check_profiler_timer,
+						    PLPGSQL_CHECK_PROFILER_TIMER_CLOCK,
+						    plpgsql_check_profiler_timer_options,
+						    PGC_USERSET, 0,
+						    plpgsql_check_profiler_timer_check_hook, NULL, NULL);
+
+	DefineCustomRealVariable("plpgsql_check.profiler_sample_rate",
+						    "fraction of calls of functions that are profiled",
+						    "Counters of profiled calls are scaled to estimate counters of all calls.",
+						    &plpgsql_check_profiler_sample_rate,
+						    1.0,
+						    0.0, 1.0,
+						    PGC_USERSET, 0,
+						    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.profiler_sql_timing",
+						    "when is true, then the time of planner and executor of queries is measured",
+						    NULL,
+						    &plpgsql_check_profiler_sql_timing,
+						    false,
+						    PGC_USERSET, 0,
+						    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.profiler_buffers",
+						    "when is true, then buffer usage of statements is collected",
+						    NULL,
+						    &plpgsql_check_profiler_buffers,
+						    false,
+						    PGC_USERSET, 0,
+						    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.profiler_activity",
+						    "when is true, then currently executed statement is published to shared memory",
+						    NULL,
+						    &plpgsql_check_profiler_activity,
+						    false,
+						    PGC_USERSET, 0,
+						    NULL, NULL, NULL);
+
 	plpgsql_check_HashTableInit();
 	plpgsql_check_profiler_init_hash_tables();
 
+	RegisterXactCallback(plpgsql_check_profiler_xact_callback, NULL);
+	RegisterSubXactCallback(plpgsql_check_profiler_subxact_callback, NULL);
+
+	/* time of planner and executor can be attributed to plpgsql statements */
+	prev_planner_hook = planner_hook;
+	planner_hook = plpgsql_check_profiler_planner;
+	prev_ExecutorRun_hook = ExecutorRun_hook;
+	ExecutorRun_hook = plpgsql_check_profiler_ExecutorRun;
+
 	/* Use shared memory when we can register more for self */
 	if (process_shared_preload_libraries_in_progress)
 	{
+		DefineCustomIntVariable("plpgsql_check.profiler_max_shared_functions",
+							    "maximum numbers of function profiles in shared memory",
+							    NULL,
+							    &plpgsql_check_profiler_max_shared_functions,
+							    1000,
+							    50, 1000000,
+							    PGC_POSTMASTER, 0,
+							    NULL, NULL, NULL);
+
+		DefineCustomIntVariable("plpgsql_check.profiler_max_shared_statements",
+							    "maximum numbers of statements of function profiles in shared memory",
+							    NULL,
+							    &plpgsql_check_profiler_max_shared_statements,
+							    30000,
+							    1000, 50000000,
+							    PGC_POSTMASTER, 0,
+							    NULL, NULL, NULL);
+
+		DefineCustomIntVariable("plpgsql_check.profiler_max_shared_edges",
+							    "maximum numbers of edges of call graph in shared memory",
+							    NULL,
+							    &plpgsql_check_profiler_max_shared_edges,
+							    5000,
+							    100, 10000000,
+							    PGC_POSTMASTER, 0,
+							    NULL, NULL, NULL);
+
+		DefineCustomBoolVariable("plpgsql_check.profiler_save",
+							    "when is true, then shared profiles are saved when server is stopped",
+							    NULL,
+							    &plpgsql_check_profiler_save,
+							    true,
+							    PGC_SIGHUP, 0,
+							    NULL, NULL, NULL);
 
 		RequestAddinShmemSpace(plpgsql_check_shmem_size());
 
 #if PG_VERSION_NUM >= 90600
 
-		RequestNamedLWLockTranche("plpgsql_check profiler", 1);
+		RequestNamedLWLockTranche("plpgsql_check profiler", PLPGSQL_CHECK_PROFILER_NUM_LOCKS);
 
 #else
 
-		RequestAddinLWLocks(1);
+		RequestAddinLWLocks(PLPGSQL_CHECK_PROFILER_NUM_LOCKS);
 
 #endif
 
@@ -165,5 +284,10 @@ void
 _PG_fini(void)
 {
 	shmem_startup_hook = prev_shmem_startup_hook;
+	planner_hook = prev_planner_hook;
+	ExecutorRun_hook = prev_ExecutorRun_hook;
+
+	UnregisterXactCallback(plpgsql_check_profiler_xact_callback, NULL);
+	UnregisterSubXactCallback(plpgsql_check_profiler_subxact_callback, NULL);
 }
 
@@ -5,7 +5,12 @@
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "access/tupdesc.h"
+#include "access/xact.h"
+#include "executor/executor.h"
+#include "optimizer/planner.h"
 #include "storage/ipc.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
 
 enum
 {
@@ -24,7 +29,12 @@ enum
 	PLPGSQL_CHECK_FORMAT_JSON,
 	PLPGSQL_SHOW_DEPENDENCY_FORMAT_TABULAR,
 	PLPGSQL_SHOW_PROFILE_TABULAR,
-	PLPGSQL_SHOW_PROFILE_STATEMENTS_TABULAR
+	PLPGSQL_SHOW_PROFILE_STATEMENTS_TABULAR,
+	PLPGSQL_SHOW_PROFILE_FUNCTIONS_ALL_TABULAR,
+	PLPGSQL_SHOW_PROFILE_TOP_STATEMENTS_TABULAR,
+	PLPGSQL_SHOW_PROFILE_CALL_GRAPH_TABULAR,
+	PLPGSQL_SHOW_PROFILE_FLAMEGRAPH_TEXT,
+	PLPGSQL_SHOW_PROFILE_ACTIVITY_TABULAR
 };
 
 enum
@@ -35,6 +45,12 @@ enum
 	PLPGSQL_CHECK_MODE_EVERY_START		/* check on every start */
 };
 
+enum
+{
+	PLPGSQL_CHECK_PROFILER_TIMER_CLOCK,		/* clock_gettime or similar system timer */
+	PLPGSQL_CHECK_PROFILER_TIMER_TSC		/* time stamp counter (x86_64 only) */
+};
+
 enum
 {
 	PLPGSQL_CHECK_CLOSED,
@@ -126,9 +142,21 @@ extern void plpgsql_check_put_error(PLpgSQL_checkstate *cstate, int sqlerrcode,
 extern void plpgsql_check_put_error_edata(PLpgSQL_checkstate *cstate, ErrorData *edata);
 extern void plpgsql_check_put_dependency(plpgsql_check_result_info *ri, char *type, Oid oid, char *schema, char *name, char *params);
 extern void plpgsql_check_put_profile(plpgsql_check_result_info *ri, int lineno, int stmt_lineno,
-	int cmds_on_row, int exec_count, int64 us_total, Datum max_time_array, Datum processed_rows_array, char *source_row);
+	int cmds_on_row, int exec_count, int64 us_total, Datum max_time_array, int64 us_self_total, Datum self_max_time_array,
+	Datum *percentile_time_arrays, Datum processed_rows_array, char *source_row);
 extern void plpgsql_check_put_profile_statement(plpgsql_check_result_info *ri, int stmtid, int parent_stmtid, const char *parent_note, int block_num, int lineno,
-	int64 exec_stmts, double total_time, double max_time, int64 processed_rows, char *stmtname);
+	int64 exec_stmts, double total_time, double max_time, double self_time, double self_max_time,
+	double planning_time, double execution_time, double *percentile_times, int64 processed_rows,
+	int64 shared_blks_hit, int64 shared_blks_read, int64 shared_blks_dirtied, int64 temp_blks_written, uint64 queryid,
+	char *stmtname);
+extern void plpgsql_check_put_profiler_functions_all(plpgsql_check_result_info *ri, Oid funcoid, int64 exec_count, double total_time,
+	double avg_time, double stddev_time, double min_time, double max_time, double *percentile_times, double calls_per_sec, TimestampTz stats_since);
+extern void plpgsql_check_put_profiler_top_statement(plpgsql_check_result_info *ri, Oid funcoid, int stmtid, int lineno, int64 exec_count,
+	int64 us_total, int64 us_max, int64 processed_rows);
+extern void plpgsql_check_put_profiler_call_graph_edge(plpgsql_check_result_info *ri, Oid caller_oid, int caller_stmtid, int caller_lineno,
+	Oid callee_oid, int64 calls, int64 us_total, int64 us_self);
+extern void plpgsql_check_put_profiler_flamegraph_line(plpgsql_check_result_info *ri, const char *line, int len);
+extern void plpgsql_check_put_profiler_activity(plpgsql_check_result_info *ri, int pid, Oid dbid, Oid funcoid, int lineno, int depth);
 
 /*
  * function from catalog.c
@@ -237,14 +265,78 @@ extern void plpgsql_check_profiler_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_s
 
 extern void plpgsql_check_profiler_show_profile(plpgsql_check_result_info *ri, plpgsql_check_info *cinfo);
 extern void plpgsql_check_profiler_show_profile_statements(plpgsql_check_result_info *ri, plpgsql_check_info *cinfo);
+extern void plpgsql_check_profiler_show_functions_all(plpgsql_check_result_info *ri);
+extern void plpgsql_check_profiler_show_top_statements(plpgsql_check_result_info *ri, int n, int order_by);
+extern void plpgsql_check_profiler_show_call_graph(plpgsql_check_result_info *ri);
+extern void plpgsql_check_profiler_show_flamegraph(plpgsql_check_result_info *ri, bool use_time);
+extern void plpgsql_check_profiler_show_activity(plpgsql_check_result_info *ri);
+
+extern void plpgsql_check_profiler_xact_callback(XactEvent event, void *arg);
+extern void plpgsql_check_profiler_subxact_callback(SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg);
+extern bool plpgsql_check_profiler_timer_check_hook(int *newval, void **extra, GucSource source);
+
+extern PlannedStmt *plpgsql_check_profiler_planner(Query *parse, int cursorOptions, ParamListInfo boundParams);
+
+#if PG_VERSION_NUM >= 100000
+
+extern void plpgsql_check_profiler_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count, bool execute_once);
+
+#elif PG_VERSION_NUM >= 90600
+
+extern void plpgsql_check_profiler_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count);
+
+#else
+
+extern void plpgsql_check_profiler_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count);
+
+#endif
 
 extern bool plpgsql_check_profiler;
+extern int plpgsql_check_profiler_flush_calls;
+extern int plpgsql_check_profiler_flush_interval;
+extern double plpgsql_check_profiler_sample_rate;
+extern bool plpgsql_check_profiler_timing;
+extern int plpgsql_check_profiler_timer;
+extern bool plpgsql_check_profiler_sql_timing;
+extern bool plpgsql_check_profiler_buffers;
+extern bool plpgsql_check_profiler_activity;
+extern int plpgsql_check_profiler_max_shared_functions;
+extern int plpgsql_check_profiler_max_shared_statements;
+extern int plpgsql_check_profiler_max_shared_edges;
+extern bool plpgsql_check_profiler_save;
+
+/*
+ * number of partitions (and locks) of shared profiles hash table
+ */
+#define PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS		16
+
+/*
+ * locks of partitions and lock of shared statements arena
+ */
+#define PLPGSQL_CHECK_PROFILER_NUM_LOCKS			(PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS + 1)
+
+/*
+ * order of plpgsql_profiler_top_statements result
+ */
+enum
+{
+	PLPGSQL_CHECK_PROFILER_ORDER_BY_TOTAL_TIME,
+	PLPGSQL_CHECK_PROFILER_ORDER_BY_MAX_TIME,
+	PLPGSQL_CHECK_PROFILER_ORDER_BY_EXEC_COUNT
+};
+
+/*
+ * number of percentiles (p50, p90, p99, p999) of statement's times
+ */
+#define PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES		4
 
 /*
  * functions from plpgsql_check.c
  */
 
 extern shmem_startup_hook_type prev_shmem_startup_hook;
+extern planner_hook_type prev_planner_hook;
+extern ExecutorRun_hook_type prev_ExecutorRun_hook;
 
 #define NEVER_READ_VARIABLE_TEXT		"never read variable \"%s\""
 #define NEVER_READ_VARIABLE_TEXT_CHECK_LENGTH		19
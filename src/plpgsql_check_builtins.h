@@ -63,5 +63,10 @@ extern PGDLLEXPORT Datum plpgsql_profiler_reset(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_reset_all(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_function_tb(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_function_statements_tb(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_functions_all_tb(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_top_statements_tb(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_call_graph_tb(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_flamegraph_tb(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_activity_tb(PG_FUNCTION_ARGS);
 
 #endif
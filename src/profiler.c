@@ -12,19 +12,78 @@
 #include "plpgsql_check.h"
 #include "plpgsql_check_builtins.h"
 
+#include <math.h>
+
 #include "access/htup_details.h"
+#include "access/transam.h"
+#include "access/xact.h"
+
+#if PG_VERSION_NUM >= 100000
+
+#include "catalog/pg_authid.h"
+
+#endif
+
 #include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
+#include "executor/spi_priv.h"
+#include "lib/ilist.h"
+#include "optimizer/planner.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/autovacuum.h"
+#include "storage/backendid.h"
+#include "storage/fd.h"
 #include "storage/lwlock.h"
 #include "storage/shmem.h"
 
+#if PG_VERSION_NUM >= 90500
+
+#include "port/atomics.h"
+
+#else
+
+#include "storage/barrier.h"
+
+#endif
+
+#if PG_VERSION_NUM >= 120000
+
+#include "replication/walsender.h"
+
+#endif
+
 #if PG_VERSION_NUM < 110000
 
 #include "storage/spin.h"
 
 #endif
 
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+/*
+ * Time stamp counter can be used as cheaper timer than clock_gettime
+ * on x86_64 platforms.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+#include <cpuid.h>
+#include <x86intrin.h>
+
+#define PROFILER_HAVE_TSC
+
+#elif defined(_MSC_VER) && defined(_M_X64)
+
+#include <intrin.h>
+
+#define PROFILER_HAVE_TSC
+
+#endif
 
 /*
  * Any instance of plpgsql function will have a own profile.
@@ -41,55 +100,351 @@ typedef struct profiler_hashkey
 	Oid			db_oid;
 	TransactionId fn_xmin;
 	ItemPointerData fn_tid;
-	int16		chunk_num;
 } profiler_hashkey;
 
 /*
- * Attention - the commands that can contains nestested commands
- * has attached own time and nested statements time too.
+ * Persistent profiles are searched only by fn_oid and db_oid, so there
+ * is only one profile of any function. When the function is changed, then
+ * the profile of older version (different fn_xmin and fn_tid) is replaced.
  */
-typedef struct profiler_stmt
+#define PROFILER_PERSISTENT_KEYSIZE		offsetof(profiler_hashkey, fn_xmin)
+
+/*
+ * Times of executions of statements are counted in histogram with
+ * log2 scale buckets. The bucket i holds times from 2^i to 2^(i+1) us
+ * (first bucket holds times less than 2us, last bucket holds all times
+ * higher than 2^19 us). Percentiles of time are calculated from histogram
+ * when profile is displayed.
+ */
+#define PROFILER_HISTOGRAM_BUCKETS		20
+
+/*
+ * Counters of statement merged to persistent profile. They are calculated
+ * from state of statement in frame, when call is finished, and they are
+ * accumulated in pending counters of profile, when profiles are flushed
+ * in batches.
+ */
+typedef struct profiler_stmt_counters
 {
-	int		lineno;
 	int64	us_max;
 	int64	us_total;
+	int64	us_self_max;
+	int64	us_self_total;
+	int64	us_plan_total;		/* time of planner */
+	int64	us_exec_total;		/* time of executor */
 	int64	rows;
 	int64	exec_count;
-	instr_time	start_time;
-	instr_time	total;
+	int64	shared_blks_hit;
+	int64	shared_blks_read;
+	int64	shared_blks_dirtied;
+	int64	temp_blks_written;
+	uint64	queryid;			/* queryid of first query executed by statement */
+	int64	histogram[PROFILER_HISTOGRAM_BUCKETS];
+} profiler_stmt_counters;
+
+/*
+ * State of statement in frame of one call. The fields updated by every
+ * execution of statement are in profiler_stmt (hot part). The others
+ * are in profiler_stmt_ext (cold part), that is allocated only when it
+ * is used first time (it is not used, when timing is off and buffers
+ * and sql timing are not collected).
+ *
+ * Attention - the total and max time of commands that can contains
+ * nestested commands is time without time of nested commands (but
+ * with time of nested calls of functions). The self time of statement
+ * is time without nested statements and without nested profiled calls
+ * of functions. Both are calculated for every execution of statement,
+ * so the max times are exact too.
+ *
+ * Only one timer is used in one call, so clock and tsc state can share
+ * same space. The times measured by tsc are converted to microseconds,
+ * when the call is finished.
+ */
+typedef struct profiler_stmt
+{
+	int64	rows;
+	int64	exec_count;
+	uint64	nested_time;		/* nested time of current execution (in units of timer) */
+	uint64	nested_calls_time;	/* part of nested time of nested profiled calls */
+	bool	executed;			/* stmtid is in executed_stmtids */
+	union
+	{
+		struct
+		{
+			instr_time	start_time;
+			uint64		us_total;
+			uint64		us_max;
+			uint64		us_self_total;
+			uint64		us_self_max;
+		}			clock;
+		struct
+		{
+			uint64		start_ticks;
+			uint64		ticks_total;
+			uint64		ticks_max;
+			uint64		self_ticks_total;
+			uint64		self_ticks_max;
+		}			tsc;
+	}			timer;
 } profiler_stmt;
 
+typedef struct profiler_stmt_ext
+{
+	int64	us_plan_total;
+	int64	us_exec_total;
+	int64	shared_blks_hit;
+	int64	shared_blks_read;
+	int64	shared_blks_dirtied;
+	int64	temp_blks_written;
+	/* buffer usage at start of current execution */
+	int64	start_shared_blks_hit;
+	int64	start_shared_blks_read;
+	int64	start_shared_blks_dirtied;
+	int64	start_temp_blks_written;
+	int64	histogram[PROFILER_HISTOGRAM_BUCKETS];
+} profiler_stmt_ext;
+
+/*
+ * The counters of shared profile are updated by atomic operations, so
+ * merging of profiles from different backends doesn't need any mutex.
+ * PostgreSQL 9.4 has not atomics, and there the counters are protected
+ * by mutex of persistent profile.
+ */
+#if PG_VERSION_NUM >= 90500
+
+#define PROFILER_ATOMIC_COUNTERS
+
+typedef pg_atomic_uint64 profiler_counter;
+
+#define profiler_counter_init(c, v)		pg_atomic_init_u64((c), (v))
+#define profiler_counter_read(c)		((int64) pg_atomic_read_u64((c)))
+#define profiler_counter_add(c, v)		pg_atomic_fetch_add_u64((c), (v))
+
+#define profiler_stmts_lock(pprofile)		((void) (pprofile))
+#define profiler_stmts_unlock(pprofile)		((void) (pprofile))
+
+typedef pg_atomic_uint32 profiler_bucket_counter;
+
+#define profiler_bucket_counter_init(c, v)	pg_atomic_init_u32((c), (uint32) Min((v), PROFILER_BUCKET_COUNTER_MAX))
+#define profiler_bucket_counter_read(c)		((int64) pg_atomic_read_u32((c)))
+
+#else
+
+typedef uint64 profiler_counter;
+
+#define profiler_counter_init(c, v)		(*(c) = (v))
+#define profiler_counter_read(c)		((int64) *(c))
+#define profiler_counter_add(c, v)		(*(c) += (v))
+
+#define profiler_stmts_lock(pprofile)		SpinLockAcquire(&(pprofile)->mutex)
+#define profiler_stmts_unlock(pprofile)		SpinLockRelease(&(pprofile)->mutex)
+
+typedef uint32 profiler_bucket_counter;
+
+#define profiler_bucket_counter_init(c, v)	(*(c) = (uint32) Min((v), PROFILER_BUCKET_COUNTER_MAX))
+#define profiler_bucket_counter_read(c)		((int64) *(c))
+
+#endif
+
+/*
+ * The buckets of histogram are most part of persistent statement, so
+ * they are stored as 32bit counters (it reduces size of statement from
+ * 272 to 192 bytes). These counters are used only for estimation of
+ * percentiles, so they are saturated instead overflow.
+ */
+#define PROFILER_BUCKET_COUNTER_MAX		((int64) 0xFFFFFFFF)
+
 typedef struct profiler_stmt_reduced
 {
 	int		lineno;
-	int64	us_max;
-	int64	us_total;
-	int64	rows;
-	int64	exec_count;
+	profiler_counter	us_max;
+	profiler_counter	us_total;
+	profiler_counter	us_self_max;
+	profiler_counter	us_self_total;
+	profiler_counter	us_plan_total;
+	profiler_counter	us_exec_total;
+	profiler_counter	rows;
+	profiler_counter	exec_count;
+	profiler_counter	shared_blks_hit;
+	profiler_counter	shared_blks_read;
+	profiler_counter	shared_blks_dirtied;
+	profiler_counter	temp_blks_written;
+	profiler_counter	queryid;
+	profiler_bucket_counter histogram[PROFILER_HISTOGRAM_BUCKETS];
 } profiler_stmt_reduced;
 
-#define		STATEMENTS_PER_CHUNK		30
+/*
+ * Statistics of calls of function. Mean and variance of call times are
+ * calculated by Welford's online algorithm, so the statistics of more
+ * calls can be merged without lost of precision. Only calls with measured
+ * time are used for time statistics (timed_calls).
+ */
+typedef struct profiler_func_stats
+{
+	int64		calls;
+	int64		timed_calls;
+	int64		total_time;
+	int64		min_time;
+	int64		max_time;
+	double		mean_time;
+	double		sum_var_time;		/* sum of squares of differences from mean */
+	int64		histogram[PROFILER_HISTOGRAM_BUCKETS];
+} profiler_func_stats;
 
 /*
- * The shared profile will be stored as set of chunks
+ * The persistent profile of function is stored as one contiguous
+ * array of statements. In shared memory, the array is allocated from
+ * shared statements arena, and it is returned to the arena when the
+ * profile is removed or replaced by profile of new version of function.
  */
-typedef struct profiler_stmt_chunk
+typedef struct profiler_persistent_profile
 {
 	profiler_hashkey key;
-	slock_t	mutex;			/* only first chunk require mutex */
-	profiler_stmt_reduced stmts[STATEMENTS_PER_CHUNK];
-} profiler_stmt_chunk;
+	dlist_node	node;				/* in list of profiles of partition */
+
+#ifndef PROFILER_ATOMIC_COUNTERS
+
+	slock_t	mutex;
+
+#endif
+
+	int			nstatements;
+	profiler_stmt_reduced *stmts;
+	slock_t		stats_mutex;		/* protects func_stats */
+	TimestampTz	stats_since;
+	profiler_func_stats func_stats;
+} profiler_persistent_profile;
+
+/*
+ * Edge of call graph - calls of some function from some statement
+ * of caller's function. The caller is identified by profile's key,
+ * the callee only by oid.
+ */
+typedef struct profiler_edge_key
+{
+	profiler_hashkey caller;
+	int			caller_stmtid;
+	Oid			callee_oid;
+} profiler_edge_key;
+
+/*
+ * Edge in session's memory - when shared memory is not available, or
+ * when the counters are not flushed to shared memory yet.
+ */
+typedef struct profiler_edge
+{
+	profiler_edge_key key;
+	int64		calls;
+	int64		total_time;
+	int64		self_time;			/* time without nested profiled calls */
+} profiler_edge;
+
+typedef struct profiler_shared_edge
+{
+	profiler_edge_key key;
+	dlist_node	node;				/* in list of edges of partition */
+	slock_t		mutex;				/* protects counters */
+	int64		calls;
+	int64		total_time;
+	int64		self_time;
+} profiler_shared_edge;
+
+/*
+ * Released blocks of shared arena are stored in one list sorted by
+ * offset. The header of free block is stored in first statement of
+ * block. Neighbour free blocks are merged, so the arena is not
+ * fragmented by profiles of different sizes.
+ */
+typedef struct profiler_arena_block
+{
+	int			nstatements;		/* size of free block */
+	int			next;				/* offset of next free block or -1 */
+} profiler_arena_block;
+
+#define profiler_arena_block_at(offset) \
+	((profiler_arena_block *) &profiler_shared_stmts[offset])
 
+/*
+ * The shared hash table of profiles is partitioned. Every partition has
+ * own lock, so inserting and removing of profiles blocks only backends
+ * that use profiles from same partition. The arena lock can be taken
+ * when the lock of partition is held, never in reverse order.
+ */
 typedef struct profiler_shared_state
 {
-	LWLock	   *lock;
+	LWLock	   *locks[PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS];
+	LWLock	   *arena_lock;			/* protects arena */
+	int			nstatements;		/* used statements of shared arena */
+	int			free_block;			/* offset of first free block or -1 */
+
+	/*
+	 * Profiles and edges are linked to lists by partitions, so monitoring
+	 * functions can read partitions one by one, and they hold lock only
+	 * of currently read partition.
+	 */
+	dlist_head	profiles[PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS];
+	dlist_head	edges[PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS];
 } profiler_shared_state;
 
 /*
- * should be enough for project of 300K PLpgSQL rows.
- * It should to take about 18MB of shared memory.
+ * Default limits are small - 30K statements (192 bytes per statement) are
+ * enough for project of 20K PLpgSQL rows. With 1000 functions and 5000 edges
+ * it takes less than 7MB of shared memory. Bigger projects should to increase
+ * plpgsql_check.profiler_max_shared_functions,
+ * plpgsql_check.profiler_max_shared_statements and
+ * plpgsql_check.profiler_max_shared_edges.
+ */
+int plpgsql_check_profiler_max_shared_functions = 1000;
+int plpgsql_check_profiler_max_shared_statements = 30000;
+int plpgsql_check_profiler_max_shared_edges = 5000;
+
+/*
+ * Every backend publishes currently executed statement of profiled
+ * function to own slot in shared memory. There is only one writer of
+ * the slot, so locks are not necessary. The writer increments changecount
+ * before and after change, so readers can detect change in progress (odd
+ * changecount) or concurrent change (changecount was changed), and then
+ * the slot should be read again.
+ */
+typedef struct profiler_backend_slot
+{
+	int			changecount;
+	int			pid;
+	Oid			dbid;
+	Oid			roleid;			/* session user */
+	Oid			fn_oid;
+	int			lineno;
+	int			depth;			/* number of active profiled calls */
+} profiler_backend_slot;
+
+#define profiler_slot_begin_write(slot) \
+	do { \
+		(slot)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define profiler_slot_end_write(slot) \
+	do { \
+		pg_write_barrier(); \
+		(slot)->changecount++; \
+	} while (0)
+
+static profiler_backend_slot *profiler_backend_slots = NULL;
+static int profiler_nbackend_slots = 0;
+static volatile profiler_backend_slot *profiler_my_slot = NULL;
+
+/*
+ * Metadata of statement used for calculation of nested time and
+ * for creating of persistent profile without iteration over
+ * statements tree.
  */
-#define		MAX_SHARED_CHUNKS		15000
+typedef struct profiler_stmt_meta
+{
+	int			parent_stmtid;		/* -1 for entry statement */
+	int			lineno;
+	bool		queryid_known;		/* queryid was read from prepared plan */
+	uint64		queryid;			/* queryid of first query of statement */
+} profiler_stmt_meta;
 
 /*
  * It is used for fast mapping plpgsql stmt -> stmtid
@@ -97,11 +452,17 @@ typedef struct profiler_shared_state
 
 #if PG_VERSION_NUM < 120000
 
+/*
+ * Without native stmtid, the map is open addressing hash table with
+ * linear probing, where statement pointer is a key. The size of table
+ * is power of 2, and the table is enlarged when it is filled from half.
+ */
+#define PROFILER_MAP_INIT_SIZE		64
+
 typedef struct profiler_map_entry
 {
 	PLpgSQL_stmt *stmt;
 	int			stmtid;
-	struct profiler_map_entry *next;
 } profiler_map_entry;
 
 /*
@@ -112,8 +473,17 @@ typedef struct profiler_profile
 	profiler_hashkey key;
 	int			nstatements;
 	PLpgSQL_stmt *entry_stmt;
-	int			stmts_map_max_lineno;
+	int			stmts_map_size;
 	profiler_map_entry *stmts_map;
+	profiler_stmt_meta *stmts_meta;
+	int			stmts_meta_size;
+	profiler_stmt_counters *pending_stmts;	/* counters not flushed to shared memory yet */
+	int		   *pending_stmtids;	/* ids of statements with pending counters */
+	int			npending_stmtids;
+	int			pending_calls;
+	profiler_func_stats pending_func_stats;
+	dlist_head	free_frames;		/* buffers of finished calls for reuse */
+	int			nfree_frames;
 } profiler_profile;
 
 #else
@@ -124,1430 +494,5367 @@ typedef struct profiler_profile
 	int			nstatements;
 	PLpgSQL_stmt *entry_stmt;
 	int		   *stmts_map;
+	profiler_stmt_meta *stmts_meta;
+	int			stmts_meta_size;
+	profiler_stmt_counters *pending_stmts;	/* counters not flushed to shared memory yet */
+	int		   *pending_stmtids;	/* ids of statements with pending counters */
+	int			npending_stmtids;
+	int			pending_calls;
+	profiler_func_stats pending_func_stats;
+	dlist_head	free_frames;		/* buffers of finished calls for reuse */
+	int			nfree_frames;
 } profiler_profile;
 
 #endif
 
 /*
- * This structure is used as plpgsql extension parameter
+ * This structure is used as plpgsql extension parameter. It is a frame
+ * of one call of function. Frames of finished calls are not released,
+ * but they are returned to free list of profile, so the next call of
+ * function (or recursive call) can reuse the frame without allocation.
  */
 typedef struct profiler_info
 {
 	profiler_profile *profile;
 	profiler_stmt *stmts;
+	profiler_stmt_ext *stmts_ext;	/* cold counters or NULL */
+	int		   *executed_stmtids;	/* ids of executed statements */
+	int			nexecuted_stmtids;
+	SubTransactionId subxid;		/* subtransaction where call started */
+	struct profiler_frame_owner *owner;	/* owner of frame of active call */
+	dlist_node	node;				/* node in active or free frames list */
 	instr_time	start_time;
+	double		sample_rate;	/* counters are scaled by 1/sample_rate */
+	bool		timing;			/* false when only counters are collected */
+	bool		buffers;		/* buffer usage of statements is collected */
+	bool		use_tsc;		/* time stamp counter is used as timer */
+	uint64		start_ticks;
+	int			current_stmtid;		/* executed statement or -1 */
+	uint64		nested_calls_us;	/* time of nested profiled calls */
+	int			sql_level;			/* nesting level of planner and executor */
+	int			depth;				/* number of active profiled calls */
 } profiler_info;
 
+/*
+ * The owner of frame is allocated in memory context of call. This context
+ * is deleted, when the call is broken by an error (at abort of subtransaction
+ * or transaction, or when the portal of CALL statement is dropped), and then
+ * the frame is released by callback. The context is not deleted by COMMIT
+ * or ROLLBACK inside procedure, so the frames of active calls are still valid.
+ * When the call is finished without error, the frame is released before, and
+ * the callback does nothing.
+ */
+typedef struct profiler_frame_owner
+{
+	profiler_info *pinfo;			/* frame or NULL, when it was released */
+
+#if PG_VERSION_NUM >= 90500
+
+	MemoryContextCallback callback;
+
+#endif
+
+} profiler_frame_owner;
+
+/*
+ * Direct mapped cache of profiles of recently called functions. The compiled
+ * function is stable until it is recompiled, so the profile can be found
+ * without hashing of profile key. The entry is valid only when key of profile
+ * is same like identity of function (pointer can be reused by other function).
+ */
+#define PROFILER_FUNC_CACHE_SIZE		64
+
+typedef struct profiler_func_cache_entry
+{
+	PLpgSQL_function *func;
+	profiler_profile *profile;
+} profiler_func_cache_entry;
+
 typedef struct profiler_iterator
 {
-	profiler_hashkey	key;
 	plpgsql_check_result_info *ri;
-	HTAB	   *chunks;
-	profiler_stmt_chunk *current_chunk;
-	int					 current_statement;
+	profiler_persistent_profile *pprofile;
 } profiler_iterator;
 
 static HTAB *profiler_HashTable = NULL;
-static HTAB *shared_profiler_chunks_HashTable = NULL;
-static HTAB *profiler_chunks_HashTable = NULL;
+static HTAB *shared_profiler_profiles_HashTable = NULL;
+static HTAB *profiler_profiles_HashTable = NULL;
+static HTAB *shared_profiler_edges_HashTable = NULL;
+static HTAB *profiler_edges_HashTable = NULL;
 
 static profiler_shared_state *profiler_ss = NULL;
+static profiler_stmt_reduced *profiler_shared_stmts = NULL;
 static MemoryContext profiler_mcxt = NULL;
 
-bool plpgsql_check_profiler = true;
+static profiler_func_cache_entry profiler_func_cache[PROFILER_FUNC_CACHE_SIZE];
 
-PG_FUNCTION_INFO_V1(plpgsql_profiler_reset_all);
-PG_FUNCTION_INFO_V1(plpgsql_profiler_reset);
+/* displayed percentiles of statement's times */
+static const double profiler_percentiles[PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES] = {0.5, 0.9, 0.99, 0.999};
 
-static void profiler_touch_stmt(profiler_info *pinfo, PLpgSQL_stmt *stmt, PLpgSQL_stmt *parent_stmt, const char *parent_note, int block_num, bool generate_map, bool finalize_profile, int64 *nested_us_total, profiler_iterator *pi);
-static void update_persistent_profile(profiler_info *pinfo, PLpgSQL_function *func);
-static void profiler_update_map(profiler_profile *profile, PLpgSQL_stmt *stmt);
-static int profiler_get_stmtid(profiler_profile *profile, PLpgSQL_stmt *stmt);
-static void profiler_touch_stmts(profiler_info *pinfo, List *stmts, PLpgSQL_stmt *parent_stmt, const char *parent_note, bool generate_map, bool finalize_profile, int64 *nested_us_total, profiler_iterator *pi);
+bool plpgsql_check_profiler = true;
+int plpgsql_check_profiler_flush_calls = 0;
+int plpgsql_check_profiler_flush_interval = 0;
+double plpgsql_check_profiler_sample_rate = 1.0;
+bool plpgsql_check_profiler_timing = true;
+int plpgsql_check_profiler_timer = PLPGSQL_CHECK_PROFILER_TIMER_CLOCK;
+bool plpgsql_check_profiler_sql_timing = false;
+bool plpgsql_check_profiler_buffers = false;
+bool plpgsql_check_profiler_activity = false;
 
-static profiler_stmt_reduced *
-get_stmt_profile_next(profiler_iterator *pi)
-{
-	if (pi->current_chunk)
-	{
-		if (pi->current_statement >= STATEMENTS_PER_CHUNK)
-		{
-			bool		found;
+/*
+ * Frequency of time stamp counter. It is calibrated when tsc timer
+ * is used first time.
+ */
+static double profiler_tsc_ticks_per_us = 0.0;
 
-			pi->key.chunk_num += 1;
+/*
+ * Lower bounds of buckets of histogram in ticks of time stamp counter,
+ * so the bucket can be found without conversion of ticks to microseconds.
+ */
+static uint64 profiler_tsc_bucket_ticks[PROFILER_HISTOGRAM_BUCKETS];
 
-			pi->current_chunk = (profiler_stmt_chunk *) hash_search(pi->chunks,
-														 (void *) &pi->key,
-														 HASH_FIND,
-														 &found);
+/*
+ * Shared profiles are saved to file when server is stopped, and they
+ * are loaded when server is started.
+ */
+#define PROFILER_DUMP_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/plpgsql_check_profiler.stat"
 
-			if (found)
-				elog(ERROR, "broken consistency of plpgsql_check profiler chunks");
+/*
+ * Magic number identifying the format of dump file. It should be changed
+ * when the format is changed. The size of statement's record is saved
+ * to file too.
+ */
+static const uint32 PROFILER_FILE_HEADER = 0x20200601;
 
-			pi->current_statement = 0;
-		}
+bool plpgsql_check_profiler_save = true;
 
-		return &pi->current_chunk->stmts[pi->current_statement++];
-	}
+/*
+ * Format of statement in dump file
+ */
+typedef struct profiler_stmt_dump
+{
+	int			lineno;
+	int64		us_max;
+	int64		us_total;
+	int64		us_self_max;
+	int64		us_self_total;
+	int64		us_plan_total;
+	int64		us_exec_total;
+	int64		rows;
+	int64		exec_count;
+	int64		shared_blks_hit;
+	int64		shared_blks_read;
+	int64		shared_blks_dirtied;
+	int64		temp_blks_written;
+	int64		queryid;
+	int64		histogram[PROFILER_HISTOGRAM_BUCKETS];
+} profiler_stmt_dump;
 
-	return NULL;
-}
+/*
+ * When profiles are flushed to shared memory in batches, then number
+ * of calls not flushed yet and time of last flush are stored here.
+ */
+static int profiler_pending_calls = 0;
+static instr_time profiler_last_flush;
+static bool profiler_exit_callback_registered = false;
+
+/*
+ * Maximal number of frames of finished calls holded by one profile.
+ * Deeper recursion requires allocation of new frames.
+ */
+#define PROFILER_MAX_FREE_FRAMES		16
 
 /*
- * Calculate required size of shared memory for chunks
+ * Frames of active calls. The frame is owned by memory context of call
+ * (SPI procedure context), and the frame of call broken by an error is
+ * released, when this context is deleted. Without memory context callbacks
+ * (PostgreSQL 9.4), the frames are released in (sub)transaction callbacks.
  *
+ * When a call is not profiled (it is not sampled or the profiler is
+ * disabled), then the marker (frame without profile) is pushed to active
+ * frames. So the profiled call nested in not profiled call is not assigned
+ * to wrong caller, and the calls nested in not sampled call are not
+ * sampled too. The markers are not released, they are reused.
  */
-Size
-plpgsql_check_shmem_size(void)
-{
-	Size		num_bytes = 0;
+static dlist_head profiler_active_frames = DLIST_STATIC_INIT(profiler_active_frames);
+static dlist_head profiler_free_markers = DLIST_STATIC_INIT(profiler_free_markers);
 
-	num_bytes = MAXALIGN(sizeof(profiler_shared_state));
-	num_bytes = add_size(num_bytes,
-						 hash_estimate_size(MAX_SHARED_CHUNKS,
-											sizeof(profiler_stmt_chunk)));
+PG_FUNCTION_INFO_V1(plpgsql_profiler_reset_all);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_reset);
 
-	return num_bytes;
-}
+static void profiler_touch_stmt(profiler_info *pinfo, PLpgSQL_stmt *stmt, PLpgSQL_stmt *parent_stmt, const char *parent_note, int block_num, bool generate_map, profiler_iterator *pi);
+static void update_persistent_profile(profiler_profile *profile, profiler_stmt_counters *stmts, int *stmtids, int nstmtids, profiler_func_stats *func_stats);
+static void profiler_flush_pending(void);
+static void profiler_shared_memory_is_full(void);
+static void profiler_reset_pending(profiler_profile *profile);
+static void profiler_discard_pending(profiler_profile *profile);
+static void profiler_update_map(profiler_profile *profile, PLpgSQL_stmt *stmt);
+static int profiler_get_stmtid(profiler_profile *profile, PLpgSQL_stmt *stmt);
+static void profiler_touch_stmts(profiler_info *pinfo, List *stmts, PLpgSQL_stmt *parent_stmt, const char *parent_note, bool generate_map, profiler_iterator *pi);
+static List *profiler_get_loop_body(PLpgSQL_stmt *stmt);
+static void profiler_update_stmts_meta(profiler_profile *profile, PLpgSQL_stmt *stmt, PLpgSQL_stmt *parent_stmt);
+
+#if PG_VERSION_NUM < 90500
+
+static void profiler_release_aborted_frames(SubTransactionId subxid);
+
+#endif
+
+static void profiler_shmem_shutdown(int code, Datum arg);
+static void profiler_load_profiles(void);
 
 /*
- * Initialize shared memory used like permanent profile storage.
- * No other parts use shared memory, so this code is completly here.
- *
+ * Increase the counter to value when value is higher. Concurrent updates
+ * are solved by compare and exchange loop.
  */
-void
-plpgsql_check_profiler_shmem_startup(void)
+static inline void
+profiler_counter_max(profiler_counter *c, int64 value)
 {
-	bool		found;
-	HASHCTL		info;
+#ifdef PROFILER_ATOMIC_COUNTERS
 
-	shared_profiler_chunks_HashTable = NULL;
+	uint64		current = pg_atomic_read_u64(c);
 
-	if (prev_shmem_startup_hook)
-		prev_shmem_startup_hook();
+	while (current < (uint64) value)
+	{
+		/* current is refreshed when exchange fails */
+		if (pg_atomic_compare_exchange_u64(c, &current, (uint64) value))
+			break;
+	}
 
-	/*
-	 * Create or attach to the shared memory state, including hash table
-	 */
-	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+#else
 
-	profiler_ss = ShmemInitStruct("plpgsql_check profiler state",
-						   sizeof(profiler_shared_state),
-						   &found);
+	if (*c < (uint64) value)
+		*c = (uint64) value;
 
-	if (!found)
-	{
+#endif
+}
 
-#if PG_VERSION_NUM > 90600
+/*
+ * Sets counter only when it is not set yet
+ */
+static inline void
+profiler_counter_set_once(profiler_counter *c, int64 value)
+{
+#ifdef PROFILER_ATOMIC_COUNTERS
+
+	uint64		expected = 0;
 
-		profiler_ss->lock = &(GetNamedLWLockTranche("plpgsql_check profiler"))->lock;
+	/* when the value is set already, then it is not changed */
+	(void) pg_atomic_compare_exchange_u64(c, &expected, (uint64) value);
 
 #else
 
-		profiler_ss->lock = LWLockAssign();
+	if (*c == 0)
+		*c = (uint64) value;
 
 #endif
+}
 
-	}
+/*
+ * Increase the bucket counter. The counter is not increased over
+ * PROFILER_BUCKET_COUNTER_MAX.
+ */
+static inline void
+profiler_bucket_counter_add(profiler_bucket_counter *c, int64 value)
+{
+#ifdef PROFILER_ATOMIC_COUNTERS
 
-	memset(&info, 0, sizeof(info));
-	info.keysize = sizeof(profiler_hashkey);
-	info.entrysize = sizeof(profiler_stmt_chunk);
-	info.hash = tag_hash;
+	uint32		current = pg_atomic_read_u32(c);
 
-#if PG_VERSION_NUM >= 90500
+	while (current < PROFILER_BUCKET_COUNTER_MAX)
+	{
+		uint32		newval = (uint32) Min(current + value, PROFILER_BUCKET_COUNTER_MAX);
 
-	shared_profiler_chunks_HashTable = ShmemInitHash("plpgsql_check profiler chunks",
-													MAX_SHARED_CHUNKS,
-													MAX_SHARED_CHUNKS,
-													&info,
-													HASH_ELEM | HASH_BLOBS);
+		/* current is refreshed when exchange fails */
+		if (pg_atomic_compare_exchange_u32(c, &current, newval))
+			break;
+	}
 
 #else
 
-	info.hash = tag_hash;
-
-	shared_profiler_chunks_HashTable = ShmemInitHash("plpgsql_check profiler chunks",
-													MAX_SHARED_CHUNKS,
-													MAX_SHARED_CHUNKS,
-													&info,
-													HASH_ELEM | HASH_FUNCTION);
+	*c = (uint32) Min(*c + value, PROFILER_BUCKET_COUNTER_MAX);
 
 #endif
-
-	LWLockRelease(AddinShmemInitLock);
 }
 
 /*
- * Profiler implementation
+ * Write profile of one statement to new (not shared yet) persistent profile
  */
-
-static void
-profiler_init_hashkey(profiler_hashkey *hk, PLpgSQL_function *func)
+static inline void
+profiler_stmt_reduced_init(profiler_stmt_reduced *prstmt, int lineno, profiler_stmt_counters *pstmt)
 {
-	memset(hk, 0, sizeof(profiler_hashkey));
+	int			i;
 
-	hk->db_oid = MyDatabaseId;
-	hk->fn_oid = func->fn_oid;
-	hk->fn_xmin = func->fn_xmin;
-	hk->fn_tid = func->fn_tid;
-	hk->chunk_num = 1;
+	prstmt->lineno = lineno;
+	profiler_counter_init(&prstmt->us_max, pstmt->us_max);
+	profiler_counter_init(&prstmt->us_total, pstmt->us_total);
+	profiler_counter_init(&prstmt->us_self_max, pstmt->us_self_max);
+	profiler_counter_init(&prstmt->us_self_total, pstmt->us_self_total);
+	profiler_counter_init(&prstmt->us_plan_total, pstmt->us_plan_total);
+	profiler_counter_init(&prstmt->us_exec_total, pstmt->us_exec_total);
+	profiler_counter_init(&prstmt->rows, pstmt->rows);
+	profiler_counter_init(&prstmt->exec_count, pstmt->exec_count);
+	profiler_counter_init(&prstmt->shared_blks_hit, pstmt->shared_blks_hit);
+	profiler_counter_init(&prstmt->shared_blks_read, pstmt->shared_blks_read);
+	profiler_counter_init(&prstmt->shared_blks_dirtied, pstmt->shared_blks_dirtied);
+	profiler_counter_init(&prstmt->temp_blks_written, pstmt->temp_blks_written);
+	profiler_counter_init(&prstmt->queryid, pstmt->queryid);
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+		profiler_bucket_counter_init(&prstmt->histogram[i], pstmt->histogram[i]);
 }
 
 /*
- * Hash table for function profiling metadata.
+ * Copy counters of persistent statement (used for displaying)
  */
-static void
-profiler_localHashTableInit(void)
+static inline void
+profiler_stmt_reduced_copy(profiler_stmt_reduced *dest, profiler_stmt_reduced *src)
 {
-	HASHCTL		ctl;
-
-	Assert(profiler_HashTable == NULL);
+	int			i;
 
-	memset(&ctl, 0, sizeof(ctl));
-	ctl.keysize = sizeof(profiler_hashkey);
-	ctl.entrysize = sizeof(profiler_profile);
-	ctl.hcxt = profiler_mcxt;
-	ctl.hash = tag_hash;
-	profiler_HashTable = hash_create("plpgsql_check function profiler local cache",
-									FUNCS_PER_USER,
-									&ctl,
-									HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	dest->lineno = src->lineno;
+	profiler_counter_init(&dest->us_max, profiler_counter_read(&src->us_max));
+	profiler_counter_init(&dest->us_total, profiler_counter_read(&src->us_total));
+	profiler_counter_init(&dest->us_self_max, profiler_counter_read(&src->us_self_max));
+	profiler_counter_init(&dest->us_self_total, profiler_counter_read(&src->us_self_total));
+	profiler_counter_init(&dest->us_plan_total, profiler_counter_read(&src->us_plan_total));
+	profiler_counter_init(&dest->us_exec_total, profiler_counter_read(&src->us_exec_total));
+	profiler_counter_init(&dest->rows, profiler_counter_read(&src->rows));
+	profiler_counter_init(&dest->exec_count, profiler_counter_read(&src->exec_count));
+	profiler_counter_init(&dest->shared_blks_hit, profiler_counter_read(&src->shared_blks_hit));
+	profiler_counter_init(&dest->shared_blks_read, profiler_counter_read(&src->shared_blks_read));
+	profiler_counter_init(&dest->shared_blks_dirtied, profiler_counter_read(&src->shared_blks_dirtied));
+	profiler_counter_init(&dest->temp_blks_written, profiler_counter_read(&src->temp_blks_written));
+	profiler_counter_init(&dest->queryid, profiler_counter_read(&src->queryid));
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+		profiler_bucket_counter_init(&dest->histogram[i], profiler_bucket_counter_read(&src->histogram[i]));
 }
 
 /*
- * Hash table for local function profiles. When shared memory is not available
+ * Returns bucket of histogram for time of execution
+ */
+static inline int
+profiler_histogram_bucket(int64 us)
+{
+	int			bucket = 0;
+
+	if (us > 1)
+	{
+#ifdef HAVE__BUILTIN_CLZ
+
+		bucket = 63 - __builtin_clzll((uint64) us);
+
+#else
+
+		while (us > 1)
+		{
+			us >>= 1;
+			bucket += 1;
+		}
+
+#endif
+	}
+
+	return Min(bucket, PROFILER_HISTOGRAM_BUCKETS - 1);
+}
+
+/*
+ * Copy histogram of shared (or local persistent) statement to local array
+ */
+static inline void
+profiler_histogram_read(profiler_bucket_counter *histogram, int64 *result)
+{
+	int			i;
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+		result[i] = profiler_bucket_counter_read(&histogram[i]);
+}
+
+/*
+ * Returns estimation of percentile of times in microseconds. The value
+ * is interpolated inside bucket, and max time is used as upper limit of
+ * last bucket. Returns -1, when there are not any data (timing was
+ * disabled).
+ */
+static double
+profiler_histogram_percentile(int64 *histogram, int64 us_max, double percentile)
+{
+	int64		total = 0;
+	int64		cumulative = 0;
+	double		rank;
+	int			i;
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+		total += histogram[i];
+
+	if (total == 0)
+		return -1.0;
+
+	rank = Max(ceil(percentile * total), 1.0);
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+	{
+		if (histogram[i] > 0 && cumulative + histogram[i] >= rank)
+		{
+			double		lower = i > 0 ? (double) ((int64) 1 << i) : 0.0;
+			double		upper = (double) ((int64) 1 << (i + 1));
+
+			/* last bucket has not upper limit */
+			if (i == PROFILER_HISTOGRAM_BUCKETS - 1)
+				upper = Max((double) us_max, lower);
+
+			return lower + (upper - lower) * (rank - cumulative) / histogram[i];
+		}
+
+		cumulative += histogram[i];
+	}
+
+	return -1.0;
+}
+
+/*
+ * Returns value * scale rounded randomly up or down with probability
+ * given by fraction part. Simple rounding is biased (with sample rate
+ * 0.4 every sampled call represents 2 calls instead of 2.5), but the
+ * expected value of randomly rounded value is exact.
+ */
+static int64
+profiler_scale_value(int64 value, double scale)
+{
+	double		x = value * scale;
+	double		result = floor(x);
+
+	if (random() < (x - result) * ((double) MAX_RANDOM_VALUE + 1))
+		result += 1.0;
+
+	return (int64) result;
+}
+
+/*
+ * Prepare statistics of one call of function
+ */
+static void
+profiler_func_stats_init_call(profiler_func_stats *stats,
+							  int64 elapsed,
+							  bool timing,
+							  double sample_rate)
+{
+	double		scale = 1.0 / sample_rate;
+
+	/* sampled call represents more calls */
+	int64		calls = sample_rate < 1.0 ? profiler_scale_value(1, scale) : 1;
+
+	memset(stats, 0, sizeof(profiler_func_stats));
+
+	stats->calls = calls;
+
+	if (timing)
+	{
+		stats->timed_calls = 1;
+		stats->total_time = sample_rate < 1.0 ? profiler_scale_value(elapsed, scale) : elapsed;
+		stats->min_time = elapsed;
+		stats->max_time = elapsed;
+		stats->mean_time = elapsed;
+		stats->histogram[profiler_histogram_bucket(elapsed)] = calls;
+	}
+}
+
+/*
+ * Merge statistics of calls. The mean and variance are merged by
+ * parallel variant of Welford's algorithm.
+ */
+static void
+profiler_func_stats_merge(profiler_func_stats *dest, profiler_func_stats *src)
+{
+	int			i;
+
+	if (src->calls == 0)
+		return;
+
+	dest->calls += src->calls;
+	dest->total_time += src->total_time;
+
+	if (src->timed_calls > 0)
+	{
+		if (dest->timed_calls == 0)
+		{
+			dest->min_time = src->min_time;
+			dest->max_time = src->max_time;
+			dest->mean_time = src->mean_time;
+			dest->sum_var_time = src->sum_var_time;
+		}
+		else
+		{
+			double		n = (double) dest->timed_calls + src->timed_calls;
+			double		delta = src->mean_time - dest->mean_time;
+
+			dest->min_time = Min(dest->min_time, src->min_time);
+			dest->max_time = Max(dest->max_time, src->max_time);
+			dest->mean_time += delta * src->timed_calls / n;
+			dest->sum_var_time += src->sum_var_time +
+								  delta * delta * dest->timed_calls * src->timed_calls / n;
+		}
+
+		dest->timed_calls += src->timed_calls;
+	}
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+		dest->histogram[i] += src->histogram[i];
+}
+
+static profiler_stmt_reduced *
+get_stmt_profile(profiler_iterator *pi, int stmtid)
+{
+	if (pi->pprofile &&
+		stmtid < pi->pprofile->nstatements)
+		return &pi->pprofile->stmts[stmtid];
+
+	return NULL;
+}
+
+/*
+ * Returns lock of partition of shared profiles, where the profile
+ * with this hashcode is stored.
+ */
+static inline int
+profiler_partition(uint32 hashcode)
+{
+	return hashcode % PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS;
+}
+
+static inline LWLock *
+profiler_partition_lock(uint32 hashcode)
+{
+	return profiler_ss->locks[profiler_partition(hashcode)];
+}
+
+/*
+ * Initialize empty lists of profiles and edges of partitions
+ */
+static void
+profiler_partition_lists_reset(void)
+{
+	int			i;
+
+	for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS; i++)
+	{
+		dlist_init(&profiler_ss->profiles[i]);
+		dlist_init(&profiler_ss->edges[i]);
+	}
+}
+
+/*
+ * Returns true, when persistent profile (k1) and profile (k2) are related
+ * to same version of function.
+ */
+static inline bool
+profiler_is_same_version(profiler_hashkey *k1, profiler_hashkey *k2)
+{
+	return k1->fn_xmin == k2->fn_xmin &&
+		   ItemPointerEquals(&k1->fn_tid, &k2->fn_tid);
+}
+
+/*
+ * Returns true, when k1 is key of older version of function than k2.
+ * The counters of older version should not to replace profile of newer
+ * version, when some backend still executes older version of function.
+ */
+static inline bool
+profiler_is_older_version(profiler_hashkey *k1, profiler_hashkey *k2)
+{
+	return TransactionIdPrecedes(k1->fn_xmin, k2->fn_xmin);
+}
+
+/*
+ * Initialize empty shared arena. Caller should to hold arena lock,
+ * when the arena can be used by other backends.
+ */
+static void
+profiler_arena_reset(void)
+{
+	profiler_ss->nstatements = 0;
+	profiler_ss->free_block = -1;
+}
+
+/*
+ * Returns released block of shared arena. The block is merged with
+ * neighbour free blocks, and the free block at end of used space is
+ * returned to unused space. Caller should to hold arena lock.
+ */
+static void
+profiler_arena_free(int offset, int nstatements)
+{
+	profiler_arena_block *block;
+	int		   *link = &profiler_ss->free_block;
+	int		   *prev_link = NULL;
+	int			prev = -1;
+	int			next;
+
+	if (nstatements <= 0)
+		return;
+
+	/* find position in list sorted by offset */
+	while ((next = *link) >= 0 && next < offset)
+	{
+		prev_link = link;
+		prev = next;
+		link = &profiler_arena_block_at(next)->next;
+	}
+
+	block = profiler_arena_block_at(offset);
+	block->nstatements = nstatements;
+	block->next = next;
+
+	/* merge with next free block */
+	if (next >= 0 && offset + nstatements == next)
+	{
+		profiler_arena_block *next_block = profiler_arena_block_at(next);
+
+		block->nstatements += next_block->nstatements;
+		block->next = next_block->next;
+	}
+
+	/* merge with previous free block */
+	if (prev >= 0 &&
+		prev + profiler_arena_block_at(prev)->nstatements == offset)
+	{
+		profiler_arena_block *prev_block = profiler_arena_block_at(prev);
+
+		prev_block->nstatements += block->nstatements;
+		prev_block->next = block->next;
+
+		offset = prev;
+		block = prev_block;
+		link = prev_link;
+	}
+	else
+		*link = offset;
+
+	/* the last free block is returned to unused space */
+	if (offset + block->nstatements == profiler_ss->nstatements)
+	{
+		profiler_ss->nstatements = offset;
+		*link = -1;
+	}
+}
+
+/*
+ * Returns offset of block of nstatements statements in shared arena
+ * or -1, when the arena is full. The first free block of enough size
+ * is used. Caller should to hold arena lock.
+ */
+static int
+profiler_arena_alloc(int nstatements)
+{
+	int		   *link = &profiler_ss->free_block;
+	int			result;
+
+	while ((result = *link) >= 0)
+	{
+		profiler_arena_block *block = profiler_arena_block_at(result);
+
+		if (block->nstatements >= nstatements)
+		{
+			/* rest of block stays in list */
+			if (block->nstatements > nstatements)
+			{
+				profiler_arena_block *rest = profiler_arena_block_at(result + nstatements);
+
+				rest->nstatements = block->nstatements - nstatements;
+				rest->next = block->next;
+				*link = result + nstatements;
+			}
+			else
+				*link = block->next;
+
+			return result;
+		}
+
+		link = &block->next;
+	}
+
+	if (profiler_ss->nstatements + nstatements > plpgsql_check_profiler_max_shared_statements)
+		return -1;
+
+	result = profiler_ss->nstatements;
+	profiler_ss->nstatements += nstatements;
+
+	return result;
+}
+
+/*
+ * Returns statements of shared persistent profile to shared arena.
+ * Caller should to hold exclusive lock of profile's partition.
+ */
+static void
+profiler_free_shared_stmts(profiler_persistent_profile *pprofile)
+{
+	LWLockAcquire(profiler_ss->arena_lock, LW_EXCLUSIVE);
+	profiler_arena_free(pprofile->stmts - profiler_shared_stmts,
+						pprofile->nstatements);
+	LWLockRelease(profiler_ss->arena_lock);
+}
+
+/*
+ * Returns current value of time stamp counter
+ */
+static inline uint64
+profiler_read_tsc(void)
+{
+#ifdef PROFILER_HAVE_TSC
+
+	return __rdtsc();
+
+#else
+
+	return 0;
+
+#endif
+}
+
+/*
+ * Time stamp counter can be used only when it has constant rate and it
+ * is not stopped in deep sleep states (invariant TSC).
+ */
+static bool
+profiler_has_invariant_tsc(void)
+{
+#if defined(PROFILER_HAVE_TSC) && defined(_MSC_VER)
+
+	int			regs[4];
+
+	__cpuid(regs, 0x80000000);
+	if ((unsigned int) regs[0] < 0x80000007)
+		return false;
+
+	__cpuid(regs, 0x80000007);
+
+	return (regs[3] & (1 << 8)) != 0;
+
+#elif defined(PROFILER_HAVE_TSC)
+
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0x80000000, NULL) < 0x80000007)
+		return false;
+
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+
+	return (edx & (1 << 8)) != 0;
+
+#else
+
+	return false;
+
+#endif
+}
+
+/*
+ * Calculate frequency of time stamp counter against monotonic clock.
+ * It is done once per session, and it takes 10ms.
+ */
+static void
+profiler_tsc_calibrate(void)
+{
+	instr_time	start_time;
+	instr_time	end_time;
+	uint64		start_ticks;
+	uint64		end_ticks;
+	int			i;
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	start_ticks = profiler_read_tsc();
+
+	pg_usleep(10000L);
+
+	INSTR_TIME_SET_CURRENT(end_time);
+	end_ticks = profiler_read_tsc();
+
+	INSTR_TIME_SUBTRACT(end_time, start_time);
+
+	profiler_tsc_ticks_per_us = (double) (end_ticks - start_ticks) /
+									(INSTR_TIME_GET_DOUBLE(end_time) * 1000000.0);
+
+	if (profiler_tsc_ticks_per_us <= 0.0)
+		elog(ERROR, "cannot to calibrate time stamp counter");
+
+	/* the bucket i holds times from 2^i us (first bucket from zero) */
+	profiler_tsc_bucket_ticks[0] = 0;
+	for (i = 1; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+		profiler_tsc_bucket_ticks[i] = (uint64) ceil((double) (INT64CONST(1) << i) *
+													 profiler_tsc_ticks_per_us);
+}
+
+/*
+ * Returns bucket of histogram for time of execution in ticks. Usually
+ * the statements are fast, so linear search from first bucket needs
+ * only few integer comparisons.
+ */
+static inline int
+profiler_histogram_bucket_ticks(uint64 ticks)
+{
+	int			bucket = 0;
+
+	while (bucket < PROFILER_HISTOGRAM_BUCKETS - 1 &&
+		   ticks >= profiler_tsc_bucket_ticks[bucket + 1])
+		bucket += 1;
+
+	return bucket;
+}
+
+static inline int64
+profiler_ticks_to_us(uint64 ticks)
+{
+	return (int64) (ticks / profiler_tsc_ticks_per_us);
+}
+
+/*
+ * check hook of plpgsql_check.profiler_timer GUC
+ */
+bool
+plpgsql_check_profiler_timer_check_hook(int *newval, void **extra, GucSource source)
+{
+	if (*newval == PLPGSQL_CHECK_PROFILER_TIMER_TSC &&
+		!profiler_has_invariant_tsc())
+	{
+		GUC_check_errdetail("Invariant time stamp counter is not available on this platform.");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns number of backend slots. MaxBackends is not calculated yet,
+ * when shared memory is requested, so it is calculated here same way.
+ */
+static int
+profiler_max_backends(void)
+{
+	int			result;
+
+	result = MaxConnections + autovacuum_max_workers + 1 + max_worker_processes;
+
+#if PG_VERSION_NUM >= 120000
+
+	result += max_wal_senders;
+
+#endif
+
+	return result;
+}
+
+/*
+ * Calculate required size of shared memory for profiles
+ *
+ */
+Size
+plpgsql_check_shmem_size(void)
+{
+	Size		num_bytes = 0;
+
+	num_bytes = MAXALIGN(sizeof(profiler_shared_state));
+	num_bytes = add_size(num_bytes,
+						 hash_estimate_size(plpgsql_check_profiler_max_shared_functions,
+											sizeof(profiler_persistent_profile)));
+	num_bytes = add_size(num_bytes,
+						 mul_size(plpgsql_check_profiler_max_shared_statements,
+								  sizeof(profiler_stmt_reduced)));
+	num_bytes = add_size(num_bytes,
+						 hash_estimate_size(plpgsql_check_profiler_max_shared_edges,
+											sizeof(profiler_shared_edge)));
+	num_bytes = add_size(num_bytes,
+						 mul_size(profiler_max_backends(),
+								  sizeof(profiler_backend_slot)));
+
+	return num_bytes;
+}
+
+/*
+ * Initialize shared memory used like permanent profile storage.
+ * No other parts use shared memory, so this code is completly here.
+ *
+ */
+void
+plpgsql_check_profiler_shmem_startup(void)
+{
+	bool		found;
+	bool		state_found;
+	HASHCTL		info;
+
+	shared_profiler_profiles_HashTable = NULL;
+	shared_profiler_edges_HashTable = NULL;
+	profiler_shared_stmts = NULL;
+	profiler_backend_slots = NULL;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	/*
+	 * Create or attach to the shared memory state, including hash table
+	 */
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	profiler_ss = ShmemInitStruct("plpgsql_check profiler state",
+						   sizeof(profiler_shared_state),
+						   &found);
+
+	state_found = found;
+
+	if (!found)
+	{
+		int			i;
+
+#if PG_VERSION_NUM > 90600
+
+		LWLockPadded *locks = GetNamedLWLockTranche("plpgsql_check profiler");
+
+		for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS; i++)
+			profiler_ss->locks[i] = &locks[i].lock;
+
+		profiler_ss->arena_lock = &locks[PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS].lock;
+
+#else
+
+		for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS; i++)
+			profiler_ss->locks[i] = LWLockAssign();
+
+		profiler_ss->arena_lock = LWLockAssign();
+
+#endif
+
+		profiler_arena_reset();
+		profiler_partition_lists_reset();
+	}
+
+	profiler_shared_stmts = ShmemInitStruct("plpgsql_check profiler statements",
+											mul_size(plpgsql_check_profiler_max_shared_statements,
+													 sizeof(profiler_stmt_reduced)),
+											&found);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = PROFILER_PERSISTENT_KEYSIZE;
+	info.entrysize = sizeof(profiler_persistent_profile);
+	info.hash = tag_hash;
+	info.num_partitions = PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS;
+
+#if PG_VERSION_NUM >= 90500
+
+	shared_profiler_profiles_HashTable = ShmemInitHash("plpgsql_check profiler profiles",
+													plpgsql_check_profiler_max_shared_functions,
+													plpgsql_check_profiler_max_shared_functions,
+													&info,
+													HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+
+#else
+
+	info.hash = tag_hash;
+
+	shared_profiler_profiles_HashTable = ShmemInitHash("plpgsql_check profiler profiles",
+													plpgsql_check_profiler_max_shared_functions,
+													plpgsql_check_profiler_max_shared_functions,
+													&info,
+													HASH_ELEM | HASH_FUNCTION | HASH_PARTITION);
+
+#endif
+
+	/* edges of call graph are protected by same partition locks */
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(profiler_edge_key);
+	info.entrysize = sizeof(profiler_shared_edge);
+	info.hash = tag_hash;
+	info.num_partitions = PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS;
+
+	shared_profiler_edges_HashTable = ShmemInitHash("plpgsql_check profiler call graph",
+													plpgsql_check_profiler_max_shared_edges,
+													plpgsql_check_profiler_max_shared_edges,
+													&info,
+													HASH_ELEM | HASH_FUNCTION | HASH_PARTITION);
+
+	profiler_nbackend_slots = profiler_max_backends();
+	profiler_backend_slots = ShmemInitStruct("plpgsql_check profiler backends",
+											 mul_size(profiler_nbackend_slots,
+													  sizeof(profiler_backend_slot)),
+											 &found);
+
+	if (!found)
+		memset(profiler_backend_slots, 0,
+			   mul_size(profiler_nbackend_slots, sizeof(profiler_backend_slot)));
+
+	LWLockRelease(AddinShmemInitLock);
+
+	/*
+	 * Only postmaster (or single user backend) saves profiles at shutdown,
+	 * and loads profiles when shared memory is created.
+	 */
+	if (!IsUnderPostmaster)
+		on_shmem_exit(profiler_shmem_shutdown, (Datum) 0);
+
+	if (!state_found)
+		profiler_load_profiles();
+}
+
+/*
+ * Save shared profiles to file. It is called from postmaster, when
+ * server is stopped, so no lock is necessary.
+ */
+static void
+profiler_shmem_shutdown(int code, Datum arg)
+{
+	FILE	   *file;
+	HASH_SEQ_STATUS hash_seq;
+	profiler_persistent_profile *pprofile;
+	profiler_shared_edge *edge;
+	int32		stmt_dump_size = sizeof(profiler_stmt_dump);
+	int32		nprofiles;
+	int32		nedges;
+
+	/* don't try to dump during a crash */
+	if (code)
+		return;
+
+	if (!profiler_ss || !shared_profiler_profiles_HashTable)
+		return;
+
+	if (!plpgsql_check_profiler_save)
+		return;
+
+	file = AllocateFile(PROFILER_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	nprofiles = hash_get_num_entries(shared_profiler_profiles_HashTable);
+
+	if (fwrite(&PROFILER_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&stmt_dump_size, sizeof(int32), 1, file) != 1 ||
+		fwrite(&nprofiles, sizeof(int32), 1, file) != 1)
+		goto error;
+
+	hash_seq_init(&hash_seq, shared_profiler_profiles_HashTable);
+
+	while ((pprofile = (profiler_persistent_profile *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		int			i,
+					j;
+
+		if (fwrite(&pprofile->key, sizeof(profiler_hashkey), 1, file) != 1 ||
+			fwrite(&pprofile->nstatements, sizeof(int), 1, file) != 1 ||
+			fwrite(&pprofile->stats_since, sizeof(TimestampTz), 1, file) != 1 ||
+			fwrite(&pprofile->func_stats, sizeof(profiler_func_stats), 1, file) != 1)
+		{
+			hash_seq_term(&hash_seq);
+			goto error;
+		}
+
+		for (i = 0; i < pprofile->nstatements; i++)
+		{
+			profiler_stmt_reduced *prstmt = &pprofile->stmts[i];
+			profiler_stmt_dump dstmt;
+
+			memset(&dstmt, 0, sizeof(profiler_stmt_dump));
+
+			dstmt.lineno = prstmt->lineno;
+			dstmt.us_max = profiler_counter_read(&prstmt->us_max);
+			dstmt.us_total = profiler_counter_read(&prstmt->us_total);
+			dstmt.us_self_max = profiler_counter_read(&prstmt->us_self_max);
+			dstmt.us_self_total = profiler_counter_read(&prstmt->us_self_total);
+			dstmt.us_plan_total = profiler_counter_read(&prstmt->us_plan_total);
+			dstmt.us_exec_total = profiler_counter_read(&prstmt->us_exec_total);
+			dstmt.rows = profiler_counter_read(&prstmt->rows);
+			dstmt.exec_count = profiler_counter_read(&prstmt->exec_count);
+			dstmt.shared_blks_hit = profiler_counter_read(&prstmt->shared_blks_hit);
+			dstmt.shared_blks_read = profiler_counter_read(&prstmt->shared_blks_read);
+			dstmt.shared_blks_dirtied = profiler_counter_read(&prstmt->shared_blks_dirtied);
+			dstmt.temp_blks_written = profiler_counter_read(&prstmt->temp_blks_written);
+			dstmt.queryid = profiler_counter_read(&prstmt->queryid);
+
+			for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+				dstmt.histogram[j] = profiler_bucket_counter_read(&prstmt->histogram[j]);
+
+			if (fwrite(&dstmt, sizeof(profiler_stmt_dump), 1, file) != 1)
+			{
+				hash_seq_term(&hash_seq);
+				goto error;
+			}
+		}
+	}
+
+	nedges = hash_get_num_entries(shared_profiler_edges_HashTable);
+
+	if (fwrite(&nedges, sizeof(int32), 1, file) != 1)
+		goto error;
+
+	hash_seq_init(&hash_seq, shared_profiler_edges_HashTable);
+
+	while ((edge = (profiler_shared_edge *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (fwrite(&edge->key, sizeof(profiler_edge_key), 1, file) != 1 ||
+			fwrite(&edge->calls, sizeof(int64), 1, file) != 1 ||
+			fwrite(&edge->total_time, sizeof(int64), 1, file) != 1 ||
+			fwrite(&edge->self_time, sizeof(int64), 1, file) != 1)
+		{
+			hash_seq_term(&hash_seq);
+			goto error;
+		}
+	}
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	/* rename file into place, so we atomically replace any old one */
+
+#if PG_VERSION_NUM >= 90600
+
+	(void) durable_rename(PROFILER_DUMP_FILE ".tmp", PROFILER_DUMP_FILE, LOG);
+
+#else
+
+	if (rename(PROFILER_DUMP_FILE ".tmp", PROFILER_DUMP_FILE) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not rename plpgsql_check profiler file \"%s\": %m",
+						PROFILER_DUMP_FILE ".tmp")));
+
+#endif
+
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write plpgsql_check profiler file \"%s\": %m",
+					PROFILER_DUMP_FILE ".tmp")));
+
+	if (file)
+		FreeFile(file);
+
+	unlink(PROFILER_DUMP_FILE ".tmp");
+}
+
+/*
+ * Remove all profiles and edges loaded from broken file. It is called
+ * from postmaster before any backend is started, so no lock is necessary.
+ */
+static void
+profiler_discard_loaded_profiles(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	profiler_persistent_profile *pprofile;
+	profiler_shared_edge *edge;
+
+	hash_seq_init(&hash_seq, shared_profiler_profiles_HashTable);
+
+	while ((pprofile = (profiler_persistent_profile *) hash_seq_search(&hash_seq)) != NULL)
+		hash_search(shared_profiler_profiles_HashTable,
+					(void *) &pprofile->key,
+					HASH_REMOVE,
+					NULL);
+
+	hash_seq_init(&hash_seq, shared_profiler_edges_HashTable);
+
+	while ((edge = (profiler_shared_edge *) hash_seq_search(&hash_seq)) != NULL)
+		hash_search(shared_profiler_edges_HashTable,
+					(void *) &edge->key,
+					HASH_REMOVE,
+					NULL);
+
+	profiler_arena_reset();
+	profiler_partition_lists_reset();
+}
+
+/*
+ * Load shared profiles saved by last shutdown. The profiles of dropped
+ * functions are not used, and the profiles of changed functions are
+ * replaced when new version of function is executed (fn_xmin and fn_tid
+ * are stored in key of profile).
+ * Every record is read and checked before it is stored to shared memory,
+ * and when the file is broken, then all loaded profiles are discarded.
+ * The file is removed after reading, so the profiles are not loaded again
+ * after crash.
+ */
+static void
+profiler_load_profiles(void)
+{
+	FILE	   *file;
+	uint32		header;
+	int32		stmt_dump_size;
+	int32		nprofiles;
+	int32		nedges;
+	profiler_stmt_dump *dstmts = NULL;
+	int			dstmts_size = 0;
+	int			i;
+
+	file = AllocateFile(PROFILER_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+
+		/* no existing persistent profiles */
+		return;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&stmt_dump_size, sizeof(int32), 1, file) != 1 ||
+		fread(&nprofiles, sizeof(int32), 1, file) != 1)
+		goto read_error;
+
+	/* the file of older format is not used */
+	if (header != PROFILER_FILE_HEADER ||
+		stmt_dump_size != sizeof(profiler_stmt_dump) ||
+		nprofiles < 0)
+		goto data_error;
+
+	for (i = 0; i < nprofiles; i++)
+	{
+		profiler_hashkey key;
+		profiler_persistent_profile *pprofile;
+		int			nstatements;
+		TimestampTz	stats_since;
+		profiler_func_stats func_stats;
+		uint32		hashcode;
+		bool		found;
+		int			j,
+					k;
+
+		if (fread(&key, sizeof(profiler_hashkey), 1, file) != 1 ||
+			fread(&nstatements, sizeof(int), 1, file) != 1 ||
+			fread(&stats_since, sizeof(TimestampTz), 1, file) != 1 ||
+			fread(&func_stats, sizeof(profiler_func_stats), 1, file) != 1)
+			goto read_error;
+
+		if (nstatements <= 0)
+			goto data_error;
+
+		/* ignore rest of file, that cannot be stored in current limits */
+		if (profiler_ss->nstatements + nstatements > plpgsql_check_profiler_max_shared_statements)
+			goto done;
+
+		if (nstatements > dstmts_size)
+		{
+			if (dstmts)
+				pfree(dstmts);
+
+			dstmts = palloc(nstatements * sizeof(profiler_stmt_dump));
+			dstmts_size = nstatements;
+		}
+
+		/* the record is stored only when it is complete */
+		if (fread(dstmts, sizeof(profiler_stmt_dump), nstatements, file) != (size_t) nstatements)
+			goto read_error;
+
+		for (j = 0; j < nstatements; j++)
+		{
+			if (dstmts[j].exec_count < 0 ||
+				dstmts[j].us_total < 0 ||
+				dstmts[j].us_max < 0)
+				goto data_error;
+		}
+
+		hashcode = get_hash_value(shared_profiler_profiles_HashTable, &key);
+
+		pprofile = (profiler_persistent_profile *) hash_search_with_hash_value(shared_profiler_profiles_HashTable,
+																			   (void *) &key,
+																			   hashcode,
+																			   HASH_ENTER_NULL,
+																			   &found);
+		if (!pprofile)
+			goto done;
+
+		if (found)
+			goto data_error;
+
+		/* only key fields used for searching are copied by hash_search */
+		pprofile->key = key;
+		dlist_push_tail(&profiler_ss->profiles[profiler_partition(hashcode)], &pprofile->node);
+		pprofile->nstatements = nstatements;
+		pprofile->stmts = &profiler_shared_stmts[profiler_arena_alloc(nstatements)];
+
+#ifndef PROFILER_ATOMIC_COUNTERS
+
+		SpinLockInit(&pprofile->mutex);
+
+#endif
+
+		SpinLockInit(&pprofile->stats_mutex);
+		pprofile->stats_since = stats_since;
+		pprofile->func_stats = func_stats;
+
+		for (j = 0; j < nstatements; j++)
+		{
+			profiler_stmt_reduced *prstmt = &pprofile->stmts[j];
+			profiler_stmt_dump *dstmt = &dstmts[j];
+
+			prstmt->lineno = dstmt->lineno;
+			profiler_counter_init(&prstmt->us_max, dstmt->us_max);
+			profiler_counter_init(&prstmt->us_total, dstmt->us_total);
+			profiler_counter_init(&prstmt->us_self_max, dstmt->us_self_max);
+			profiler_counter_init(&prstmt->us_self_total, dstmt->us_self_total);
+			profiler_counter_init(&prstmt->us_plan_total, dstmt->us_plan_total);
+			profiler_counter_init(&prstmt->us_exec_total, dstmt->us_exec_total);
+			profiler_counter_init(&prstmt->rows, dstmt->rows);
+			profiler_counter_init(&prstmt->exec_count, dstmt->exec_count);
+			profiler_counter_init(&prstmt->shared_blks_hit, dstmt->shared_blks_hit);
+			profiler_counter_init(&prstmt->shared_blks_read, dstmt->shared_blks_read);
+			profiler_counter_init(&prstmt->shared_blks_dirtied, dstmt->shared_blks_dirtied);
+			profiler_counter_init(&prstmt->temp_blks_written, dstmt->temp_blks_written);
+			profiler_counter_init(&prstmt->queryid, dstmt->queryid);
+
+			for (k = 0; k < PROFILER_HISTOGRAM_BUCKETS; k++)
+				profiler_bucket_counter_init(&prstmt->histogram[k], dstmt->histogram[k]);
+		}
+	}
+
+	if (fread(&nedges, sizeof(int32), 1, file) != 1)
+		goto read_error;
+
+	if (nedges < 0)
+		goto data_error;
+
+	for (i = 0; i < nedges; i++)
+	{
+		profiler_edge_key key;
+		profiler_shared_edge *edge;
+		int64		calls;
+		int64		total_time;
+		int64		self_time;
+		uint32		hashcode;
+		bool		found;
+
+		if (fread(&key, sizeof(profiler_edge_key), 1, file) != 1 ||
+			fread(&calls, sizeof(int64), 1, file) != 1 ||
+			fread(&total_time, sizeof(int64), 1, file) != 1 ||
+			fread(&self_time, sizeof(int64), 1, file) != 1)
+			goto read_error;
+
+		if (calls < 0 || total_time < 0 || self_time < 0)
+			goto data_error;
+
+		hashcode = get_hash_value(shared_profiler_edges_HashTable, &key);
+
+		edge = (profiler_shared_edge *) hash_search_with_hash_value(shared_profiler_edges_HashTable,
+																	(void *) &key,
+																	hashcode,
+																	HASH_ENTER_NULL,
+																	&found);
+		if (!edge)
+			goto done;
+
+		if (found)
+			goto data_error;
+
+		dlist_push_tail(&profiler_ss->edges[profiler_partition(hashcode)], &edge->node);
+		SpinLockInit(&edge->mutex);
+		edge->calls = calls;
+		edge->total_time = total_time;
+		edge->self_time = self_time;
+	}
+
+done:
+	if (dstmts)
+		pfree(dstmts);
+
+	FreeFile(file);
+
+	unlink(PROFILER_DUMP_FILE);
+
+	return;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read plpgsql_check profiler file \"%s\": %m",
+					PROFILER_DUMP_FILE)));
+	goto fail;
+
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in plpgsql_check profiler file \"%s\"",
+					PROFILER_DUMP_FILE)));
+
+fail:
+	if (dstmts)
+		pfree(dstmts);
+
+	if (file)
+		FreeFile(file);
+
+	/* partially loaded content of broken file is not used */
+	profiler_discard_loaded_profiles();
+
+	/* don't try to load broken file again */
+	unlink(PROFILER_DUMP_FILE);
+}
+
+/*
+ * Profiler implementation
+ */
+
+static void
+profiler_init_hashkey(profiler_hashkey *hk, PLpgSQL_function *func)
+{
+	memset(hk, 0, sizeof(profiler_hashkey));
+
+	hk->db_oid = MyDatabaseId;
+	hk->fn_oid = func->fn_oid;
+	hk->fn_xmin = func->fn_xmin;
+	hk->fn_tid = func->fn_tid;
+}
+
+/*
+ * Returns slot of profiles cache for compiled function. The lowest bits
+ * of pointer are same for all functions due alignment.
+ */
+static inline profiler_func_cache_entry *
+profiler_func_cache_slot(PLpgSQL_function *func)
+{
+	return &profiler_func_cache[((uintptr_t) func >> 4) % PROFILER_FUNC_CACHE_SIZE];
+}
+
+/*
+ * Returns cached profile of function or NULL
+ */
+static inline profiler_profile *
+profiler_func_cache_lookup(PLpgSQL_function *func)
+{
+	profiler_func_cache_entry *entry = profiler_func_cache_slot(func);
+
+	if (entry->func == func)
+	{
+		profiler_profile *profile = entry->profile;
+
+		if (profile->key.fn_oid == func->fn_oid &&
+			profile->key.fn_xmin == func->fn_xmin &&
+			ItemPointerEquals(&profile->key.fn_tid, &func->fn_tid))
+			return profile;
+	}
+
+	return NULL;
+}
+
+/*
+ * Hash table for function profiling metadata.
+ */
+static void
+profiler_localHashTableInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(profiler_HashTable == NULL);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(profiler_hashkey);
+	ctl.entrysize = sizeof(profiler_profile);
+	ctl.hcxt = profiler_mcxt;
+	ctl.hash = tag_hash;
+	profiler_HashTable = hash_create("plpgsql_check function profiler local cache",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+}
+
+/*
+ * Hash table for local function profiles. When shared memory is not available
  * because plpgsql_check was not loaded by shared_proload_libraries, then function
- * profiles is stored in local profile chunks. A format is same for shared profiles.
+ * profiles is stored in local persistent profiles. A format is same for shared
+ * profiles, but statements are allocated in profiler_mcxt.
+ */
+static void
+profiler_profiles_HashTableInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(profiler_profiles_HashTable == NULL);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = PROFILER_PERSISTENT_KEYSIZE;
+	ctl.entrysize = sizeof(profiler_persistent_profile);
+	ctl.hcxt = profiler_mcxt;
+	ctl.hash = tag_hash;
+	profiler_profiles_HashTable = hash_create("plpgsql_check function profiler local profiles",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+}
+
+/*
+ * Hash table for edges of call graph. When shared memory is available,
+ * then it holds only edges not flushed to shared memory yet.
+ */
+static void
+profiler_edges_HashTableInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(profiler_edges_HashTable == NULL);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(profiler_edge_key);
+	ctl.entrysize = sizeof(profiler_edge);
+	ctl.hcxt = profiler_mcxt;
+	ctl.hash = tag_hash;
+	profiler_edges_HashTable = hash_create("plpgsql_check function profiler local call graph",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+}
+
+void
+plpgsql_check_profiler_init_hash_tables(void)
+{
+	if (profiler_mcxt)
+	{
+		MemoryContextReset(profiler_mcxt);
+
+		profiler_HashTable = NULL;
+		profiler_profiles_HashTable = NULL;
+		profiler_edges_HashTable = NULL;
+		profiler_pending_calls = 0;
+
+		/* cached profiles are released now */
+		memset(profiler_func_cache, 0, sizeof(profiler_func_cache));
+	}
+	else
+	{
+		profiler_mcxt = AllocSetContextCreate(TopMemoryContext,
+												"plpgsql_check - profiler context",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+	}
+
+	profiler_localHashTableInit();
+	profiler_profiles_HashTableInit();
+	profiler_edges_HashTableInit();
+}
+
+/*
+ * profiler_touch_stmt - iterator over plpgsql statements.
+ *
+ * This function is designed for two different purposes:
+ *
+ *   a) assign unique id to every plpgsql statement and
+ *      create statement -> id mapping and statements metadata
+ *   b) iterate over all commands and prepare result for
+ *      plpgsql_profiler_function_statements_tb function.
+ *
+ */
+static void
+profiler_touch_stmt(profiler_info *pinfo,
+					PLpgSQL_stmt *stmt,
+					PLpgSQL_stmt *parent_stmt,
+					const char *parent_note,
+					int block_num,
+					bool generate_map,
+					profiler_iterator *pi)
+{
+	profiler_profile *profile = pinfo->profile;
+
+	if (pi)
+	{
+		int		stmtid = profiler_get_stmtid(profile, stmt);
+		int		parent_stmtid = parent_stmt ? profiler_get_stmtid(profile, parent_stmt) : -1;
+		profiler_stmt_reduced *pstmt;
+		double	percentile_times[PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES];
+		int		i;
+
+		pstmt = get_stmt_profile(pi, stmtid);
+
+		if (pstmt)
+		{
+			int64		histogram[PROFILER_HISTOGRAM_BUCKETS];
+
+			profiler_histogram_read(pstmt->histogram, histogram);
+
+			for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; i++)
+				percentile_times[i] = profiler_histogram_percentile(histogram,
+																	profiler_counter_read(&pstmt->us_max),
+																	profiler_percentiles[i]);
+		}
+		else
+		{
+			for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; i++)
+				percentile_times[i] = -1.0;
+		}
+
+		plpgsql_check_put_profile_statement(pi->ri,
+											stmtid,
+											parent_stmtid,
+											parent_note,
+											block_num,
+											stmt->lineno,
+											pstmt ? profiler_counter_read(&pstmt->exec_count) : 0,
+											pstmt ? profiler_counter_read(&pstmt->us_total) : 0.0,
+											pstmt ? profiler_counter_read(&pstmt->us_max) : 0.0,
+											pstmt ? profiler_counter_read(&pstmt->us_self_total) : 0.0,
+											pstmt ? profiler_counter_read(&pstmt->us_self_max) : 0.0,
+											pstmt ? profiler_counter_read(&pstmt->us_plan_total) : 0.0,
+											pstmt ? profiler_counter_read(&pstmt->us_exec_total) : 0.0,
+											percentile_times,
+											pstmt ? profiler_counter_read(&pstmt->rows) : 0,
+											pstmt ? profiler_counter_read(&pstmt->shared_blks_hit) : 0,
+											pstmt ? profiler_counter_read(&pstmt->shared_blks_read) : 0,
+											pstmt ? profiler_counter_read(&pstmt->shared_blks_dirtied) : 0,
+											pstmt ? profiler_counter_read(&pstmt->temp_blks_written) : 0,
+											pstmt ? profiler_counter_read(&pstmt->queryid) : 0,
+											(char *) plpgsql_stmt_typename(stmt));
+
+		parent_note = NULL;
+	}
+	else if (generate_map)
+	{
+		profiler_update_map(profile, stmt);
+		profiler_update_stmts_meta(profile, stmt, parent_stmt);
+	}
+
+	switch (PLPGSQL_STMT_TYPES stmt->cmd_type)
+	{
+		case PLPGSQL_STMT_BLOCK:
+			{
+				PLpgSQL_stmt_block *stmt_block = (PLpgSQL_stmt_block *) stmt;
+
+				profiler_touch_stmts(pinfo,
+									 stmt_block->body,
+									 stmt,
+									 "body",
+									 generate_map,
+									 pi);
+
+				if (stmt_block->exceptions)
+				{
+					ListCell *lc;
+					char	buffer[20];
+					int		n = 0;
+
+					foreach(lc, stmt_block->exceptions->exc_list)
+					{
+						sprintf(buffer, "exception %d", ++n);
+
+						profiler_touch_stmts(pinfo,
+											 ((PLpgSQL_exception *) lfirst(lc))->action,
+											 stmt,
+											 (const char *) buffer,
+											 generate_map,
+											 pi);
+					}
+				}
+			}
+			break;
+
+		case PLPGSQL_STMT_IF:
+			{
+				PLpgSQL_stmt_if *stmt_if = (PLpgSQL_stmt_if *) stmt;
+				ListCell *lc;
+
+				profiler_touch_stmts(pinfo,
+									 stmt_if->then_body,
+									 stmt,
+									 "then body",
+									 generate_map,
+									 pi);
+
+				foreach(lc, stmt_if->elsif_list)
+				{
+					int		n = 0;
+					char buffer[20];
+
+					sprintf(buffer, "elsif %d", ++n);
+					profiler_touch_stmts(pinfo,
+										 ((PLpgSQL_if_elsif *) lfirst(lc))->stmts,
+										 stmt,
+										 (const char *) buffer,
+										 generate_map,
+										 pi);
+				}
+
+				profiler_touch_stmts(pinfo,
+									 stmt_if->else_body,
+									 stmt,
+									 "else body",
+									 generate_map,
+									 pi);
+			}
+			break;
+
+		case PLPGSQL_STMT_CASE:
+			{
+				PLpgSQL_stmt_case *stmt_case = (PLpgSQL_stmt_case *) stmt;
+				ListCell *lc;
+
+				foreach(lc, stmt_case->case_when_list)
+				{
+					char	buffer[20];
+					int		n = 0;
+
+					sprintf(buffer, "case when %d", ++n);
+					profiler_touch_stmts(pinfo,
+										 ((PLpgSQL_case_when *) lfirst(lc))->stmts,
+										 stmt,
+										 (const char *) buffer,
+										 generate_map,
+										 pi);
+				}
+
+				profiler_touch_stmts(pinfo,
+									 stmt_case->else_stmts,
+									 stmt,
+									 "case else",
+									 generate_map,
+									 pi);
+			}
+			break;
+
+		case PLPGSQL_STMT_LOOP:
+		case PLPGSQL_STMT_WHILE:
+		case PLPGSQL_STMT_FORI:
+		case PLPGSQL_STMT_FORS:
+		case PLPGSQL_STMT_FORC:
+		case PLPGSQL_STMT_DYNFORS:
+		case PLPGSQL_STMT_FOREACH_A:
+			profiler_touch_stmts(pinfo,
+								 profiler_get_loop_body(stmt),
+								 stmt,
+								 "loop body",
+								 generate_map,
+								 pi);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Remove edges of call graph related to function. When fn_oid is
+ * InvalidOid, then all edges are removed. The edges of shared call
+ * graph should be locked by caller.
+ */
+static void
+profiler_remove_edges(HTAB *edges, Oid fn_oid)
+{
+	HASH_SEQ_STATUS hash_seq;
+	profiler_edge_key *key;
+
+	hash_seq_init(&hash_seq, edges);
+
+	/* the key is first field of local and shared edge */
+	while ((key = (profiler_edge_key *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!OidIsValid(fn_oid) ||
+			(key->caller.db_oid == MyDatabaseId &&
+			 (key->caller.fn_oid == fn_oid || key->callee_oid == fn_oid)))
+			hash_search(edges, key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Remove edges of shared call graph related to function. The partitions
+ * are locked one by one.
+ */
+static void
+profiler_remove_shared_edges(Oid fn_oid)
+{
+	int			i;
+
+	for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS; i++)
+	{
+		dlist_mutable_iter iter;
+
+		LWLockAcquire(profiler_ss->locks[i], LW_EXCLUSIVE);
+
+		dlist_foreach_modify(iter, &profiler_ss->edges[i])
+		{
+			profiler_shared_edge *edge = dlist_container(profiler_shared_edge, node, iter.cur);
+
+			if (edge->key.caller.db_oid == MyDatabaseId &&
+				(edge->key.caller.fn_oid == fn_oid || edge->key.callee_oid == fn_oid))
+			{
+				dlist_delete(&edge->node);
+				hash_search(shared_profiler_edges_HashTable,
+							(void *) &edge->key,
+							HASH_REMOVE,
+							NULL);
+			}
+		}
+
+		LWLockRelease(profiler_ss->locks[i]);
+	}
+}
+
+/*
+ * Returns true, when the edge is from statement of other version of
+ * function than the version of the key.
+ */
+static inline bool
+profiler_is_stale_edge(profiler_edge_key *ekey, profiler_hashkey *key)
+{
+	return ekey->caller.fn_oid == key->fn_oid &&
+		   ekey->caller.db_oid == key->db_oid &&
+		   !profiler_is_same_version(&ekey->caller, key);
+}
+
+/*
+ * Removes edges from statements of other versions of function. The stmtid
+ * of these edges has not sense for new version of function, so these edges
+ * are removed when the profile of function is replaced.
+ */
+static void
+profiler_remove_stale_edges(profiler_hashkey *key)
+{
+	/* edges of this session, that are not flushed yet */
+	if (profiler_edges_HashTable)
+	{
+		HASH_SEQ_STATUS hash_seq;
+		profiler_edge *edge;
+
+		hash_seq_init(&hash_seq, profiler_edges_HashTable);
+
+		while ((edge = (profiler_edge *) hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (profiler_is_stale_edge(&edge->key, key))
+				hash_search(profiler_edges_HashTable, &edge->key, HASH_REMOVE, NULL);
+		}
+	}
+
+	if (shared_profiler_edges_HashTable)
+	{
+		int			i;
+
+		for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS; i++)
+		{
+			dlist_mutable_iter iter;
+
+			LWLockAcquire(profiler_ss->locks[i], LW_EXCLUSIVE);
+
+			dlist_foreach_modify(iter, &profiler_ss->edges[i])
+			{
+				profiler_shared_edge *edge = dlist_container(profiler_shared_edge, node, iter.cur);
+
+				if (profiler_is_stale_edge(&edge->key, key))
+				{
+					dlist_delete(&edge->node);
+					hash_search(shared_profiler_edges_HashTable,
+								(void *) &edge->key,
+								HASH_REMOVE,
+								NULL);
+				}
+			}
+
+			LWLockRelease(profiler_ss->locks[i]);
+		}
+	}
+}
+
+/*
+ * clean all profiles used by profiler
+ */
+Datum
+plpgsql_profiler_reset_all(PG_FUNCTION_ARGS)
+{
+	if (shared_profiler_profiles_HashTable)
+	{
+		HASH_SEQ_STATUS			hash_seq;
+		profiler_persistent_profile *pprofile;
+		profiler_profile	   *profile;
+		int			i;
+
+		/* counters of this session not flushed yet are removed too */
+		hash_seq_init(&hash_seq, profiler_HashTable);
+
+		while ((profile = (profiler_profile *) hash_seq_search(&hash_seq)) != NULL)
+			profiler_discard_pending(profile);
+
+		profiler_remove_edges(profiler_edges_HashTable, InvalidOid);
+
+		/* all partitions should be locked (in fixed order) */
+		for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS; i++)
+			LWLockAcquire(profiler_ss->locks[i], LW_EXCLUSIVE);
+
+		hash_seq_init(&hash_seq, shared_profiler_profiles_HashTable);
+
+		while ((pprofile = hash_seq_search(&hash_seq)) != NULL)
+		{
+			hash_search(shared_profiler_profiles_HashTable, &(pprofile->key), HASH_REMOVE, NULL);
+		}
+
+		profiler_remove_edges(shared_profiler_edges_HashTable, InvalidOid);
+
+		/* now, nobody uses shared statements */
+		LWLockAcquire(profiler_ss->arena_lock, LW_EXCLUSIVE);
+		profiler_arena_reset();
+		LWLockRelease(profiler_ss->arena_lock);
+
+		profiler_partition_lists_reset();
+
+		for (i = PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS - 1; i >= 0; i--)
+			LWLockRelease(profiler_ss->locks[i]);
+	}
+	else
+	{
+		HASH_SEQ_STATUS			hash_seq;
+		profiler_persistent_profile *pprofile;
+
+		/*
+		 * The profiler's memory context cannot be reseted here, because
+		 * metadata and frames of active calls are there.
+		 */
+		hash_seq_init(&hash_seq, profiler_profiles_HashTable);
+
+		while ((pprofile = hash_seq_search(&hash_seq)) != NULL)
+		{
+			pfree(pprofile->stmts);
+			hash_search(profiler_profiles_HashTable, &(pprofile->key), HASH_REMOVE, NULL);
+		}
+
+		profiler_remove_edges(profiler_edges_HashTable, InvalidOid);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Clean profile related to some function
+ */
+Datum
+plpgsql_profiler_reset(PG_FUNCTION_ARGS)
+{
+	Oid			funcoid = PG_GETARG_OID(0);
+	profiler_hashkey hk;
+	HeapTuple	procTuple;
+	profiler_profile *profile;
+
+	procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcoid));
+	if (!HeapTupleIsValid(procTuple))
+		elog(ERROR, "cache lookup failed for function %u", funcoid);
+
+	/* ensure correct complete content of hash key */
+	memset(&hk, 0, sizeof(profiler_hashkey));
+	hk.fn_oid = funcoid;
+	hk.db_oid = MyDatabaseId;
+	hk.fn_xmin = HeapTupleHeaderGetRawXmin(procTuple->t_data);
+	hk.fn_tid =  procTuple->t_self;
+
+	ReleaseSysCache(procTuple);
+
+	/* counters of this session not flushed yet are removed too */
+	profile = (profiler_profile *) hash_search(profiler_HashTable,
+											   (void *) &hk,
+											   HASH_FIND,
+											   NULL);
+	if (profile)
+		profiler_discard_pending(profile);
+
+	profiler_remove_edges(profiler_edges_HashTable, funcoid);
+
+	if (shared_profiler_profiles_HashTable)
+	{
+		uint32		hashcode = get_hash_value(shared_profiler_profiles_HashTable, &hk);
+		LWLock	   *lock = profiler_partition_lock(hashcode);
+		profiler_persistent_profile *pprofile;
+
+		/* the profile of any version of function is removed */
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+
+		pprofile = (profiler_persistent_profile *) hash_search_with_hash_value(shared_profiler_profiles_HashTable,
+																			   (void *) &hk,
+																			   hashcode,
+																			   HASH_FIND,
+																			   NULL);
+		if (pprofile)
+		{
+			profiler_free_shared_stmts(pprofile);
+			dlist_delete(&pprofile->node);
+			hash_search_with_hash_value(shared_profiler_profiles_HashTable,
+										(void *) &hk,
+										hashcode,
+										HASH_REMOVE,
+										NULL);
+		}
+
+		LWLockRelease(lock);
+
+		/* edges of function can be in any partition */
+		profiler_remove_shared_edges(funcoid);
+	}
+	else
+	{
+		profiler_persistent_profile *pprofile;
+
+		pprofile = (profiler_persistent_profile *) hash_search(profiler_profiles_HashTable,
+															   (void *) &hk,
+															   HASH_FIND,
+															   NULL);
+
+		if (pprofile)
+		{
+			pfree(pprofile->stmts);
+			hash_search(profiler_profiles_HashTable, (void *) &hk, HASH_REMOVE, NULL);
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Merge counters of statements to persistent profile. Only statements
+ * specified by stmtids are merged (other statements was not executed).
+ */
+static void
+update_persistent_profile(profiler_profile *profile,
+						  profiler_stmt_counters *stmts,
+						  int *stmtids,
+						  int nstmtids,
+						  profiler_func_stats *func_stats)
+{
+	profiler_persistent_profile *pprofile;
+	bool		found;
+	int			i,
+				j;
+	HTAB	   *profiles;
+	bool		shared_profiles;
+	uint32		hashcode;
+	LWLock	   *lock = NULL;
+	bool		exclusive_lock = false;
+	bool		replaced = false;
+	volatile bool unlock_mutex = false;
+
+	if (shared_profiler_profiles_HashTable)
+	{
+		profiles = shared_profiler_profiles_HashTable;
+		shared_profiles = true;
+	}
+	else
+	{
+		profiles = profiler_profiles_HashTable;
+		shared_profiles = false;
+	}
+
+	hashcode = get_hash_value(profiles, &profile->key);
+
+	/* don't need too strong lock for shared memory */
+	if (shared_profiles)
+	{
+		lock = profiler_partition_lock(hashcode);
+		LWLockAcquire(lock, LW_SHARED);
+	}
+
+	pprofile = (profiler_persistent_profile *) hash_search_with_hash_value(profiles,
+																		   (void *) &profile->key,
+																		   hashcode,
+																		   HASH_FIND,
+																		   &found);
+
+	/* there is profile of other version of function */
+	if (found && !profiler_is_same_version(&pprofile->key, &profile->key))
+	{
+		/* counters of older version are not stored */
+		if (profiler_is_older_version(&profile->key, &pprofile->key))
+		{
+			if (shared_profiles)
+				LWLockRelease(lock);
+
+			return;
+		}
+
+		found = false;
+	}
+
+	if (!found)
+	{
+		if (shared_profiles)
+		{
+			/* We need exclusive lock, but only for partition of this profile */
+			LWLockRelease(lock);
+			LWLockAcquire(lock, LW_EXCLUSIVE);
+			exclusive_lock = true;
+
+			pprofile = (profiler_persistent_profile *) hash_search_with_hash_value(profiles,
+																				   (void *) &profile->key,
+																				   hashcode,
+																				   HASH_ENTER_NULL,
+																				   &found);
+
+			if (!pprofile)
+			{
+				LWLockRelease(lock);
+				profiler_shared_memory_is_full();
+				return;
+			}
+
+			/* profile of other version could be created before exclusive lock */
+			if (found && !profiler_is_same_version(&pprofile->key, &profile->key))
+			{
+				if (profiler_is_older_version(&profile->key, &pprofile->key))
+				{
+					LWLockRelease(lock);
+					return;
+				}
+
+				/* the profile of older version is replaced */
+				profiler_free_shared_stmts(pprofile);
+				replaced = true;
+				found = false;
+			}
+
+			/* statements of new profile are allocated in shared arena */
+			if (!found)
+			{
+				int			offset;
+
+				LWLockAcquire(profiler_ss->arena_lock, LW_EXCLUSIVE);
+				offset = profiler_arena_alloc(profile->nstatements);
+				LWLockRelease(profiler_ss->arena_lock);
+
+				if (offset < 0)
+				{
+					if (replaced)
+						dlist_delete(&pprofile->node);
+
+					hash_search_with_hash_value(profiles,
+												(void *) &profile->key,
+												hashcode,
+												HASH_REMOVE,
+												NULL);
+					LWLockRelease(lock);
+
+					if (replaced)
+						profiler_remove_stale_edges(&profile->key);
+
+					profiler_shared_memory_is_full();
+					return;
+				}
+
+				pprofile->stmts = &profiler_shared_stmts[offset];
+
+				if (!replaced)
+					dlist_push_tail(&profiler_ss->profiles[profiler_partition(hashcode)],
+									&pprofile->node);
+
+#ifndef PROFILER_ATOMIC_COUNTERS
+
+				SpinLockInit(&pprofile->mutex);
+
+#endif
+
+			}
+		}
+		else
+		{
+			profiler_stmt_reduced *stmts_old;
+
+			pprofile = (profiler_persistent_profile *) hash_search_with_hash_value(profiles,
+																				   (void *) &profile->key,
+																				   hashcode,
+																				   HASH_ENTER,
+																				   &found);
+
+			stmts_old = found ? pprofile->stmts : NULL;
+
+			pprofile->stmts = MemoryContextAlloc(profiler_mcxt,
+												 profile->nstatements * sizeof(profiler_stmt_reduced));
+
+			/* the profile of older version is replaced */
+			if (stmts_old)
+			{
+				pfree(stmts_old);
+				replaced = true;
+			}
+
+			found = false;
+		}
+	}
+
+	if (!found)
+	{
+		/* only key fields used for searching are copied by hash_search */
+		pprofile->key = profile->key;
+		pprofile->nstatements = profile->nstatements;
+
+		for (i = 0; i < profile->nstatements; i++)
+			profiler_stmt_reduced_init(&pprofile->stmts[i],
+									   profile->stmts_meta[i].lineno,
+									   &stmts[i]);
+
+		SpinLockInit(&pprofile->stats_mutex);
+		pprofile->stats_since = GetCurrentTimestamp();
+		pprofile->func_stats = *func_stats;
+
+		if (shared_profiles)
+			LWLockRelease(lock);
+
+		/* edges are in other partitions, so they are removed after release of lock */
+		if (replaced)
+			profiler_remove_stale_edges(&profile->key);
+
+		return;
+	}
+
+	if (pprofile->nstatements != profile->nstatements)
+		elog(ERROR, "broken consistency of plpgsql_check profiler profiles");
+
+	/*
+	 * There is a persistent profile already. The shared lock protects profile
+	 * against removing, the counters are updated atomically. Without
+	 * atomics, we should to lock persistent profile, if we have not exclusive lock.
+	 */
+	PG_TRY();
+	{
+		if (shared_profiles && !exclusive_lock)
+		{
+			profiler_stmts_lock(pprofile);
+			unlock_mutex = true;
+		}
+
+		for (i = 0; i < nstmtids; i++)
+		{
+			int			stmtid = stmtids[i];
+			profiler_stmt_reduced *prstmt = &pprofile->stmts[stmtid];
+			profiler_stmt_counters *pstmt = &stmts[stmtid];
+
+			if (prstmt->lineno != profile->stmts_meta[stmtid].lineno)
+				elog(ERROR, "broken consistency of plpgsql_check profiler profiles");
+
+			/* don't touch shared memory when there is nothing to add */
+			if (pstmt->exec_count == 0)
+				continue;
+
+			profiler_counter_max(&prstmt->us_max, pstmt->us_max);
+			profiler_counter_add(&prstmt->us_total, pstmt->us_total);
+			profiler_counter_max(&prstmt->us_self_max, pstmt->us_self_max);
+			profiler_counter_add(&prstmt->us_self_total, pstmt->us_self_total);
+
+			if (pstmt->us_plan_total > 0)
+				profiler_counter_add(&prstmt->us_plan_total, pstmt->us_plan_total);
+
+			if (pstmt->us_exec_total > 0)
+				profiler_counter_add(&prstmt->us_exec_total, pstmt->us_exec_total);
+
+			profiler_counter_add(&prstmt->rows, pstmt->rows);
+			profiler_counter_add(&prstmt->exec_count, pstmt->exec_count);
+
+			/* buffer usage is collected only when it is enabled */
+			if (pstmt->shared_blks_hit > 0 || pstmt->shared_blks_read > 0 ||
+				pstmt->shared_blks_dirtied > 0 || pstmt->temp_blks_written > 0)
+			{
+				profiler_counter_add(&prstmt->shared_blks_hit, pstmt->shared_blks_hit);
+				profiler_counter_add(&prstmt->shared_blks_read, pstmt->shared_blks_read);
+				profiler_counter_add(&prstmt->shared_blks_dirtied, pstmt->shared_blks_dirtied);
+				profiler_counter_add(&prstmt->temp_blks_written, pstmt->temp_blks_written);
+			}
+
+			if (pstmt->queryid != 0)
+				profiler_counter_set_once(&prstmt->queryid, pstmt->queryid);
+
+			for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+				if (pstmt->histogram[j] > 0)
+					profiler_bucket_counter_add(&prstmt->histogram[j], pstmt->histogram[j]);
+		}
+	}
+	PG_CATCH();
+	{
+		if (unlock_mutex)
+			profiler_stmts_unlock(pprofile);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (unlock_mutex)
+		profiler_stmts_unlock(pprofile);
+
+	SpinLockAcquire(&pprofile->stats_mutex);
+	profiler_func_stats_merge(&pprofile->func_stats, func_stats);
+	SpinLockRelease(&pprofile->stats_mutex);
+
+	if (shared_profiles)
+		LWLockRelease(lock);
+}
+
+/*
+ * Returns local copy of persistent profile (or NULL). The counters are
+ * copied under short lock, so the monitoring queries don't block updates
+ * of profile when result is formatted.
+ */
+static profiler_persistent_profile *
+profiler_copy_persistent_profile(profiler_hashkey *hk)
+{
+	profiler_persistent_profile *pprofile;
+	profiler_persistent_profile *result = NULL;
+	HTAB	   *profiles;
+	uint32		hashcode;
+	LWLock	   *lock = NULL;
+	bool		shared_profiles;
+
+	/* try to find persistent profile in shared (or local) memory */
+	if (shared_profiler_profiles_HashTable)
+	{
+		/* show counters of this session too */
+		profiler_flush_pending();
+
+		profiles = shared_profiler_profiles_HashTable;
+		hashcode = get_hash_value(profiles, hk);
+
+		lock = profiler_partition_lock(hashcode);
+		LWLockAcquire(lock, LW_SHARED);
+		shared_profiles = true;
+	}
+	else
+	{
+		profiles = profiler_profiles_HashTable;
+		hashcode = get_hash_value(profiles, hk);
+		shared_profiles = false;
+	}
+
+	pprofile = (profiler_persistent_profile *) hash_search_with_hash_value(profiles,
+																		   (void *) hk,
+																		   hashcode,
+																		   HASH_FIND,
+																		   NULL);
+
+	/* profile of other version of function is not used */
+	if (pprofile && profiler_is_same_version(&pprofile->key, hk))
+	{
+		int			i;
+
+		/* memory should not be allocated under spinlock */
+		result = palloc(sizeof(profiler_persistent_profile));
+		result->key = pprofile->key;
+		result->nstatements = pprofile->nstatements;
+		result->stmts = palloc(pprofile->nstatements * sizeof(profiler_stmt_reduced));
+
+		if (shared_profiles)
+			profiler_stmts_lock(pprofile);
+
+		for (i = 0; i < pprofile->nstatements; i++)
+			profiler_stmt_reduced_copy(&result->stmts[i], &pprofile->stmts[i]);
+
+		if (shared_profiles)
+			profiler_stmts_unlock(pprofile);
+
+		SpinLockAcquire(&pprofile->stats_mutex);
+		result->stats_since = pprofile->stats_since;
+		result->func_stats = pprofile->func_stats;
+		SpinLockRelease(&pprofile->stats_mutex);
+	}
+
+	if (shared_profiles)
+		LWLockRelease(lock);
+
+	return result;
+}
+
+/*
+ * Profile of function is not stored when shared memory for profiles is
+ * full. The user is informed once per session.
+ */
+static void
+profiler_shared_memory_is_full(void)
+{
+	static bool warning_was_raised = false;
+
+	if (!warning_was_raised)
+	{
+		warning_was_raised = true;
+
+		ereport(WARNING,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("plpgsql_check profiler has not free shared memory for new profiles"),
+				 errhint("You might need to increase plpgsql_check.profiler_max_shared_functions, plpgsql_check.profiler_max_shared_statements or plpgsql_check.profiler_max_shared_edges.")));
+	}
+}
+
+/*
+ * Returns time of statement without time of nested statements. It is
+ * used as total and max time of statement, so the time of compound
+ * statements is not counted twice (like in older releases). The time
+ * of nested calls (in expressions of statement) is not subtracted.
+ */
+static inline uint64
+profiler_stmt_own_time(profiler_stmt *pstmt, uint64 elapsed)
+{
+	uint64		nested_stmts_time = pstmt->nested_time - pstmt->nested_calls_time;
+
+	return elapsed > nested_stmts_time ? elapsed - nested_stmts_time : 0;
+}
+
+/*
+ * Calculate counters of statement from state of statement in frame. The
+ * times measured by tsc are converted to microseconds here, so ticks are
+ * converted only once per call. The counters of sampled call are scaled,
+ * so the profile shows estimation of counters of all calls. The values
+ * are rounded randomly, so the estimation is not biased. The max time is
+ * not scaled.
+ */
+static void
+profiler_stmt_get_counters(profiler_info *pinfo,
+						   int stmtid,
+						   profiler_stmt_counters *counters)
+{
+	profiler_stmt *pstmt = &pinfo->stmts[stmtid];
+
+	memset(counters, 0, sizeof(profiler_stmt_counters));
+
+	counters->rows = pstmt->rows;
+	counters->exec_count = pstmt->exec_count;
+	counters->queryid = pinfo->profile->stmts_meta[stmtid].queryid;
+
+	if (pinfo->use_tsc)
+	{
+		counters->us_total = profiler_ticks_to_us(pstmt->timer.tsc.ticks_total);
+		counters->us_max = profiler_ticks_to_us(pstmt->timer.tsc.ticks_max);
+		counters->us_self_total = profiler_ticks_to_us(pstmt->timer.tsc.self_ticks_total);
+		counters->us_self_max = profiler_ticks_to_us(pstmt->timer.tsc.self_ticks_max);
+	}
+	else if (pinfo->timing)
+	{
+		counters->us_total = pstmt->timer.clock.us_total;
+		counters->us_max = pstmt->timer.clock.us_max;
+		counters->us_self_total = pstmt->timer.clock.us_self_total;
+		counters->us_self_max = pstmt->timer.clock.us_self_max;
+	}
+
+	if (pinfo->stmts_ext)
+	{
+		profiler_stmt_ext *pext = &pinfo->stmts_ext[stmtid];
+
+		counters->us_plan_total = pext->us_plan_total;
+		counters->us_exec_total = pext->us_exec_total;
+		counters->shared_blks_hit = pext->shared_blks_hit;
+		counters->shared_blks_read = pext->shared_blks_read;
+		counters->shared_blks_dirtied = pext->shared_blks_dirtied;
+		counters->temp_blks_written = pext->temp_blks_written;
+		memcpy(counters->histogram, pext->histogram, sizeof(counters->histogram));
+	}
+
+	if (pinfo->sample_rate < 1.0)
+	{
+		double		scale = 1.0 / pinfo->sample_rate;
+		int			i;
+
+		counters->us_total = profiler_scale_value(counters->us_total, scale);
+		counters->us_self_total = profiler_scale_value(counters->us_self_total, scale);
+		counters->us_plan_total = profiler_scale_value(counters->us_plan_total, scale);
+		counters->us_exec_total = profiler_scale_value(counters->us_exec_total, scale);
+		counters->rows = profiler_scale_value(counters->rows, scale);
+		counters->exec_count = profiler_scale_value(counters->exec_count, scale);
+		counters->shared_blks_hit = profiler_scale_value(counters->shared_blks_hit, scale);
+		counters->shared_blks_read = profiler_scale_value(counters->shared_blks_read, scale);
+		counters->shared_blks_dirtied = profiler_scale_value(counters->shared_blks_dirtied, scale);
+		counters->temp_blks_written = profiler_scale_value(counters->temp_blks_written, scale);
+
+		for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+			if (counters->histogram[i] > 0)
+				counters->histogram[i] = profiler_scale_value(counters->histogram[i], scale);
+	}
+}
+
+/*
+ * Add counters of finished call to session's pending counters of
+ * the function profile.
+ */
+static void
+profiler_accumulate_pending(profiler_profile *profile,
+							profiler_info *pinfo,
+							profiler_func_stats *func_stats)
+{
+	int			i,
+				j;
+
+	if (!profile->pending_stmts)
+	{
+		profile->pending_stmts = MemoryContextAllocZero(profiler_mcxt,
+											profile->nstatements * sizeof(profiler_stmt_counters));
+		profile->pending_stmtids = MemoryContextAlloc(profiler_mcxt,
+											profile->nstatements * sizeof(int));
+		profile->npending_stmtids = 0;
+	}
+
+	for (i = 0; i < pinfo->nexecuted_stmtids; i++)
+	{
+		int			stmtid = pinfo->executed_stmtids[i];
+		profiler_stmt_counters counters;
+		profiler_stmt_counters *ppstmt = &profile->pending_stmts[stmtid];
+
+		profiler_stmt_get_counters(pinfo, stmtid, &counters);
+
+		if (counters.exec_count == 0)
+			continue;
+
+		if (ppstmt->exec_count == 0)
+			profile->pending_stmtids[profile->npending_stmtids++] = stmtid;
+
+		if (ppstmt->us_max < counters.us_max)
+			ppstmt->us_max = counters.us_max;
+
+		if (ppstmt->us_self_max < counters.us_self_max)
+			ppstmt->us_self_max = counters.us_self_max;
+
+		ppstmt->us_total += counters.us_total;
+		ppstmt->us_self_total += counters.us_self_total;
+		ppstmt->us_plan_total += counters.us_plan_total;
+		ppstmt->us_exec_total += counters.us_exec_total;
+		ppstmt->rows += counters.rows;
+		ppstmt->exec_count += counters.exec_count;
+		ppstmt->shared_blks_hit += counters.shared_blks_hit;
+		ppstmt->shared_blks_read += counters.shared_blks_read;
+		ppstmt->shared_blks_dirtied += counters.shared_blks_dirtied;
+		ppstmt->temp_blks_written += counters.temp_blks_written;
+
+		if (ppstmt->queryid == 0)
+			ppstmt->queryid = counters.queryid;
+
+		for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+			ppstmt->histogram[j] += counters.histogram[j];
+	}
+
+	profiler_func_stats_merge(&profile->pending_func_stats, func_stats);
+
+	profile->pending_calls += 1;
+	profiler_pending_calls += 1;
+}
+
+/*
+ * Add counters of calls to edge of call graph in session's memory
+ */
+static void
+profiler_accumulate_edge(profiler_edge_key *key,
+						 int64 calls,
+						 int64 total_time,
+						 int64 self_time)
+{
+	profiler_edge *edge;
+	bool		found;
+
+	edge = (profiler_edge *) hash_search(profiler_edges_HashTable,
+										 (void *) key,
+										 HASH_ENTER,
+										 &found);
+
+	if (!found)
+	{
+		edge->calls = 0;
+		edge->total_time = 0;
+		edge->self_time = 0;
+	}
+
+	edge->calls += calls;
+	edge->total_time += total_time;
+	edge->self_time += self_time;
+}
+
+/*
+ * Add counters of calls to edge of call graph in shared memory
+ */
+static void
+profiler_update_shared_edge(profiler_edge_key *key,
+							int64 calls,
+							int64 total_time,
+							int64 self_time)
+{
+	profiler_shared_edge *edge;
+	uint32		hashcode;
+	LWLock	   *lock;
+	bool		found;
+
+	hashcode = get_hash_value(shared_profiler_edges_HashTable, key);
+	lock = profiler_partition_lock(hashcode);
+
+	LWLockAcquire(lock, LW_SHARED);
+
+	edge = (profiler_shared_edge *) hash_search_with_hash_value(shared_profiler_edges_HashTable,
+																(void *) key,
+																hashcode,
+																HASH_FIND,
+																&found);
+
+	if (!found)
+	{
+		LWLockRelease(lock);
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+
+		edge = (profiler_shared_edge *) hash_search_with_hash_value(shared_profiler_edges_HashTable,
+																	(void *) key,
+																	hashcode,
+																	HASH_ENTER_NULL,
+																	&found);
+
+		if (!edge)
+		{
+			LWLockRelease(lock);
+			profiler_shared_memory_is_full();
+			return;
+		}
+
+		if (!found)
+		{
+			dlist_push_tail(&profiler_ss->edges[profiler_partition(hashcode)], &edge->node);
+			SpinLockInit(&edge->mutex);
+			edge->calls = 0;
+			edge->total_time = 0;
+			edge->self_time = 0;
+		}
+	}
+
+	SpinLockAcquire(&edge->mutex);
+	edge->calls += calls;
+	edge->total_time += total_time;
+	edge->self_time += self_time;
+	SpinLockRelease(&edge->mutex);
+
+	LWLockRelease(lock);
+}
+
+/*
+ * Add finished call to edge from caller's statement. The time of call
+ * is nested time of caller, so the self time of caller can be calculated.
+ */
+static void
+profiler_update_call_edge(profiler_info *pinfo,
+						  profiler_info *caller,
+						  uint64 elapsed,
+						  bool batching)
+{
+	profiler_edge_key key;
+	double		scale = 1.0 / pinfo->sample_rate;
+	int64		calls = 1;
+	int64		total_time;
+	int64		self_time;
+	int			caller_stmtid = caller->current_stmtid;
+
+	/* the calls from declarations are calls from entry statement */
+	if (caller_stmtid < 0)
+		caller_stmtid = profiler_get_stmtid(caller->profile, caller->profile->entry_stmt);
+
+	self_time = elapsed > pinfo->nested_calls_us ? elapsed - pinfo->nested_calls_us : 0;
+	caller->nested_calls_us += elapsed;
+
+	/* the time of call is not self time of caller's statement */
+	if (caller->use_tsc || caller->timing)
+	{
+		profiler_stmt *caller_pstmt = &caller->stmts[caller_stmtid];
+		uint64		nested_time;
+
+		nested_time = caller->use_tsc ? (uint64) (elapsed * profiler_tsc_ticks_per_us) : elapsed;
+
+		caller_pstmt->nested_time += nested_time;
+		caller_pstmt->nested_calls_time += nested_time;
+	}
+
+	memset(&key, 0, sizeof(profiler_edge_key));
+	key.caller = caller->profile->key;
+	key.caller_stmtid = caller_stmtid;
+	key.callee_oid = pinfo->profile->key.fn_oid;
+
+	if (pinfo->sample_rate < 1.0)
+	{
+		calls = profiler_scale_value(1, scale);
+		total_time = profiler_scale_value(elapsed, scale);
+		self_time = profiler_scale_value(self_time, scale);
+	}
+	else
+		total_time = elapsed;
+
+	if (shared_profiler_edges_HashTable && !batching)
+		profiler_update_shared_edge(&key, calls, total_time, self_time);
+	else
+		profiler_accumulate_edge(&key, calls, total_time, self_time);
+}
+
+/*
+ * Merge pending counters of one profile to persistent profile.
+ */
+static void
+profiler_flush_profile(profiler_profile *profile)
+{
+	update_persistent_profile(profile,
+							  profile->pending_stmts,
+							  profile->pending_stmtids,
+							  profile->npending_stmtids,
+							  &profile->pending_func_stats);
+
+	profiler_reset_pending(profile);
+	profiler_pending_calls -= profile->pending_calls;
+	profile->pending_calls = 0;
+}
+
+/*
+ * Merge all pending counters of this session to shared memory.
+ */
+static void
+profiler_flush_pending(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	profiler_profile *profile;
+
+	if (profiler_pending_calls == 0)
+		return;
+
+	hash_seq_init(&hash_seq, profiler_HashTable);
+
+	while ((profile = (profiler_profile *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (profile->pending_calls > 0)
+			profiler_flush_profile(profile);
+	}
+
+	if (hash_get_num_entries(profiler_edges_HashTable) > 0)
+	{
+		profiler_edge *edge;
+
+		hash_seq_init(&hash_seq, profiler_edges_HashTable);
+
+		while ((edge = (profiler_edge *) hash_seq_search(&hash_seq)) != NULL)
+		{
+			profiler_update_shared_edge(&edge->key,
+										edge->calls,
+										edge->total_time,
+										edge->self_time);
+
+			hash_search(profiler_edges_HashTable, &edge->key, HASH_REMOVE, NULL);
+		}
+	}
+
+	profiler_pending_calls = 0;
+	INSTR_TIME_SET_CURRENT(profiler_last_flush);
+}
+
+/*
+ * Clean pending counters of statements
+ */
+static void
+profiler_reset_pending(profiler_profile *profile)
+{
+	int			i;
+
+	for (i = 0; i < profile->npending_stmtids; i++)
+		memset(&profile->pending_stmts[profile->pending_stmtids[i]], 0, sizeof(profiler_stmt_counters));
+
+	profile->npending_stmtids = 0;
+
+	memset(&profile->pending_func_stats, 0, sizeof(profiler_func_stats));
+}
+
+/*
+ * Forget pending counters (used when profiles are reseted)
+ */
+static void
+profiler_discard_pending(profiler_profile *profile)
+{
+	if (profile->pending_calls > 0)
+	{
+		profiler_reset_pending(profile);
+		profiler_pending_calls -= profile->pending_calls;
+		profile->pending_calls = 0;
+	}
+}
+
+/*
+ * Pending counters should be flushed before backend exit. When backend
+ * exits by FATAL error, then some our lock can be still holded, so all
+ * locks should be released before.
+ */
+static void
+profiler_exit_callback(int code, Datum arg)
+{
+	if (shared_profiler_profiles_HashTable && profiler_pending_calls > 0)
+	{
+		LWLockReleaseAll();
+		profiler_flush_pending();
+	}
+}
+
+/*
+ * Pending counters are flushed at the end of transaction. The flush is
+ * done before commit, when errors are still allowed. The frames of broken
+ * calls are released by owners (memory contexts of calls). Without memory
+ * context callbacks (and without transaction control in procedures), all
+ * active frames are released at the end of transaction.
+ */
+void
+plpgsql_check_profiler_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+
+#if PG_VERSION_NUM >= 90500
+
+		case XACT_EVENT_PARALLEL_PRE_COMMIT:
+
+#endif
+
+		case XACT_EVENT_PRE_PREPARE:
+			if (shared_profiler_profiles_HashTable && profiler_pending_calls > 0)
+				profiler_flush_pending();
+			break;
+
+		case XACT_EVENT_ABORT:
+
+#if PG_VERSION_NUM >= 90500
+
+		case XACT_EVENT_PARALLEL_ABORT:
+
+#endif
+
+			/* after abort, pending counters are flushed later */
+
+#if PG_VERSION_NUM < 90500
+
+			profiler_release_aborted_frames(InvalidSubTransactionId);
+
+#endif
+
+			break;
+
+		case XACT_EVENT_COMMIT:
+
+#if PG_VERSION_NUM >= 90500
+
+		case XACT_EVENT_PARALLEL_COMMIT:
+
+#endif
+
+		case XACT_EVENT_PREPARE:
+
+#if PG_VERSION_NUM < 90500
+
+			profiler_release_aborted_frames(InvalidSubTransactionId);
+
+#endif
+
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Release frames of calls broken by an error, that was handled
+ * by exception block. Only without memory context callbacks.
+ */
+void
+plpgsql_check_profiler_subxact_callback(SubXactEvent event,
+										SubTransactionId mySubid,
+										SubTransactionId parentSubid,
+										void *arg)
+{
+
+#if PG_VERSION_NUM < 90500
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		profiler_release_aborted_frames(mySubid);
+
+#endif
+
+}
+
+#if PG_VERSION_NUM < 120000
+
+/*
+ * Fibonacci hashing of statement pointer. The high bits of product
+ * are used, because the low bits of pointers are same.
+ */
+static inline uint32
+profiler_map_hash(PLpgSQL_stmt *stmt)
+{
+	return (uint32) (((uint64) (uintptr_t) stmt * UINT64CONST(0x9E3779B97F4A7C15)) >> 32);
+}
+
+static void
+profiler_map_insert(profiler_profile *profile, PLpgSQL_stmt *stmt, int stmtid)
+{
+	uint32		mask = profile->stmts_map_size - 1;
+	uint32		i;
+
+	for (i = profiler_map_hash(stmt) & mask;
+		 profile->stmts_map[i].stmt != NULL;
+		 i = (i + 1) & mask)
+		;
+
+	profile->stmts_map[i].stmt = stmt;
+	profile->stmts_map[i].stmtid = stmtid;
+}
+
+#endif
+
+/*
+ * PLpgSQL statements has not unique id. We can assign some unique id
+ * that can be used for statements counters. Fast access to this id
+ * is implemented via map structure. It is a hash table (before PostgreSQL 12).
+ *
+ * From PostgreSQL 12 we can use stmtid, but still we need map table,
+ * because native stmtid has different order against lineno. But with
+ * native stmtid, a creating map and searching in map is much faster.
+ */
+static void
+profiler_update_map(profiler_profile *profile, PLpgSQL_stmt *stmt)
+{
+#if PG_VERSION_NUM < 120000
+
+	/* enlarge map, when it is filled from half */
+	if ((profile->nstatements + 1) * 2 > profile->stmts_map_size)
+	{
+		profiler_map_entry *old_map = profile->stmts_map;
+		int			old_size = profile->stmts_map_size;
+		int			i;
+
+		profile->stmts_map_size = old_size * 2;
+		profile->stmts_map = MemoryContextAllocZero(profiler_mcxt,
+													profile->stmts_map_size * sizeof(profiler_map_entry));
+
+		for (i = 0; i < old_size; i++)
+			if (old_map[i].stmt)
+				profiler_map_insert(profile, old_map[i].stmt, old_map[i].stmtid);
+
+		pfree(old_map);
+	}
+
+	profiler_map_insert(profile, stmt, profile->nstatements++);
+
+#else
+
+	profile->stmts_map[stmt->stmtid - 1] = profile->nstatements++;
+
+#endif
+
+}
+
+/*
+ * Returns statement id assigned to plpgsql statement. Should be
+ * fast, because it is called for every executed statement.
+ */
+static int
+profiler_get_stmtid(profiler_profile *profile, PLpgSQL_stmt *stmt)
+{
+#if PG_VERSION_NUM < 120000
+
+	uint32		mask = profile->stmts_map_size - 1;
+	uint32		i;
+
+	for (i = profiler_map_hash(stmt) & mask;; i = (i + 1) & mask)
+	{
+		profiler_map_entry *pme = &profile->stmts_map[i];
+
+		if (pme->stmt == stmt)
+			return pme->stmtid;
+
+		/* we should to find statement */
+		if (!pme->stmt)
+			elog(ERROR, "broken statement map - cannot to find statement");
+	}
+
+#else
+
+	return profile->stmts_map[stmt->stmtid - 1];
+
+#endif
+}
+
+static void
+profiler_touch_stmts(profiler_info *pinfo,
+					 List *stmts,
+					 PLpgSQL_stmt *parent_stmt,
+					 const char *parent_note,
+					 bool generate_map,
+					 profiler_iterator *pi)
+{
+	ListCell *lc;
+	int		  block_num = 1;
+
+	foreach(lc, stmts)
+	{
+		PLpgSQL_stmt *stmt = (PLpgSQL_stmt *) lfirst(lc);
+
+		profiler_touch_stmt(pinfo,
+							stmt,
+							parent_stmt,
+							parent_note,
+							block_num++,
+							generate_map,
+							pi);
+	}
+}
+
+/*
+ * Returns body of loop statements
+ */
+static List *
+profiler_get_loop_body(PLpgSQL_stmt *stmt)
+{
+	switch (PLPGSQL_STMT_TYPES stmt->cmd_type)
+	{
+		case PLPGSQL_STMT_LOOP:
+			return ((PLpgSQL_stmt_loop *) stmt)->body;
+		case PLPGSQL_STMT_WHILE:
+			return ((PLpgSQL_stmt_while *) stmt)->body;
+		case PLPGSQL_STMT_FORI:
+			return ((PLpgSQL_stmt_fori *) stmt)->body;
+		case PLPGSQL_STMT_FORS:
+			return ((PLpgSQL_stmt_fors *) stmt)->body;
+		case PLPGSQL_STMT_FORC:
+			return ((PLpgSQL_stmt_forc *) stmt)->body;
+		case PLPGSQL_STMT_DYNFORS:
+			return ((PLpgSQL_stmt_dynfors *) stmt)->body;
+		case PLPGSQL_STMT_FOREACH_A:
+			return ((PLpgSQL_stmt_foreach_a *) stmt)->body;
+		default:
+			return NIL;
+	}
+}
+
+/*
+ * Returns expression of statement, that is evaluated first, or NULL
+ */
+static PLpgSQL_expr *
+profiler_get_stmt_expr(PLpgSQL_stmt *stmt)
+{
+	switch (PLPGSQL_STMT_TYPES stmt->cmd_type)
+	{
+		case PLPGSQL_STMT_ASSIGN:
+			return ((PLpgSQL_stmt_assign *) stmt)->expr;
+		case PLPGSQL_STMT_PERFORM:
+			return ((PLpgSQL_stmt_perform *) stmt)->expr;
+		case PLPGSQL_STMT_IF:
+			return ((PLpgSQL_stmt_if *) stmt)->cond;
+		case PLPGSQL_STMT_CASE:
+			return ((PLpgSQL_stmt_case *) stmt)->t_expr;
+		case PLPGSQL_STMT_WHILE:
+			return ((PLpgSQL_stmt_while *) stmt)->cond;
+		case PLPGSQL_STMT_FORI:
+			return ((PLpgSQL_stmt_fori *) stmt)->lower;
+		case PLPGSQL_STMT_FORS:
+			return ((PLpgSQL_stmt_fors *) stmt)->query;
+		case PLPGSQL_STMT_FOREACH_A:
+			return ((PLpgSQL_stmt_foreach_a *) stmt)->expr;
+		case PLPGSQL_STMT_EXIT:
+			return ((PLpgSQL_stmt_exit *) stmt)->cond;
+		case PLPGSQL_STMT_RETURN:
+			return ((PLpgSQL_stmt_return *) stmt)->expr;
+		case PLPGSQL_STMT_RETURN_NEXT:
+			return ((PLpgSQL_stmt_return_next *) stmt)->expr;
+		case PLPGSQL_STMT_RETURN_QUERY:
+			return ((PLpgSQL_stmt_return_query *) stmt)->query;
+		case PLPGSQL_STMT_EXECSQL:
+			return ((PLpgSQL_stmt_execsql *) stmt)->sqlstmt;
+		case PLPGSQL_STMT_OPEN:
+			return ((PLpgSQL_stmt_open *) stmt)->query;
+
+#if PG_VERSION_NUM >= 90500
+
+		case PLPGSQL_STMT_ASSERT:
+			return ((PLpgSQL_stmt_assert *) stmt)->cond;
+
+#endif
+
+#if PG_VERSION_NUM >= 110000
+
+		case PLPGSQL_STMT_CALL:
+			return ((PLpgSQL_stmt_call *) stmt)->expr;
+
+#endif
+
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Returns queryid of first query of prepared plan of expression. The
+ * queryid is assigned by post parse analyze hook of some extension (like
+ * pg_stat_statements), and it is kept in queries of plan source. So the
+ * queryid is known for simple expressions too (they are not executed by
+ * executor). Returns false, when the expression is not prepared yet.
+ */
+static bool
+profiler_get_expr_queryid(PLpgSQL_expr *expr, uint64 *queryid)
+{
+	SPIPlanPtr	plan = expr->plan;
+	ListCell   *lc;
+
+	*queryid = 0;
+
+	if (plan == NULL || plan->magic != _SPI_PLAN_MAGIC)
+		return false;
+
+	foreach(lc, plan->plancache_list)
+	{
+		CachedPlanSource *plansource = (CachedPlanSource *) lfirst(lc);
+		ListCell   *lc2;
+
+		foreach(lc2, plansource->query_list)
+		{
+			Query	   *query = (Query *) lfirst(lc2);
+
+			if (query->queryId != 0)
+			{
+				*queryid = query->queryId;
+				return true;
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Reads queryid of statement from prepared plan. It is done only once
+ * for statement of profile, when the plan of statement is prepared.
+ */
+static void
+profiler_update_stmt_queryid(profiler_stmt_meta *meta, PLpgSQL_stmt *stmt)
+{
+	PLpgSQL_expr *expr = profiler_get_stmt_expr(stmt);
+
+	if (!expr)
+		meta->queryid_known = true;
+	else
+		meta->queryid_known = profiler_get_expr_queryid(expr, &meta->queryid);
+}
+
+/*
+ * Statements metadata are stored in flat array indexed by stmtid. Because
+ * the stmtid are assigned in preorder, then parent statement has always
+ * lower stmtid than its nested statements.
+ */
+static void
+profiler_update_stmts_meta(profiler_profile *profile,
+						   PLpgSQL_stmt *stmt,
+						   PLpgSQL_stmt *parent_stmt)
+{
+	int			stmtid = profiler_get_stmtid(profile, stmt);
+	profiler_stmt_meta *meta;
+
+	if (stmtid >= profile->stmts_meta_size)
+	{
+		int		size = profile->stmts_meta_size;
+
+		while (stmtid >= size)
+			size = size > 0 ? size * 2 : 64;
+
+		if (profile->stmts_meta)
+		{
+			profile->stmts_meta = repalloc(profile->stmts_meta,
+										   size * sizeof(profiler_stmt_meta));
+
+			/* metadata of not touched statements should not be garbage */
+			memset(&profile->stmts_meta[profile->stmts_meta_size], 0,
+				   (size - profile->stmts_meta_size) * sizeof(profiler_stmt_meta));
+		}
+		else
+			profile->stmts_meta = MemoryContextAllocZero(profiler_mcxt,
+														 size * sizeof(profiler_stmt_meta));
+
+		profile->stmts_meta_size = size;
+	}
+
+	meta = &profile->stmts_meta[stmtid];
+
+	meta->parent_stmtid = parent_stmt ? profiler_get_stmtid(profile, parent_stmt) : -1;
+	meta->lineno = stmt->lineno;
+	meta->queryid_known = false;
+	meta->queryid = 0;
+}
+
+/*
+ * Prepare tuplestore with function profile
+ *
+ */
+void
+plpgsql_check_profiler_show_profile_statements(plpgsql_check_result_info *ri,
+									plpgsql_check_info *cinfo)
+{
+	PLpgSQL_function *function = NULL;
+
+#if PG_VERSION_NUM >= 120000
+
+	LOCAL_FCINFO(fake_fcinfo, 0);
+
+#else
+
+	FunctionCallInfoData fake_fcinfo_data;
+	FunctionCallInfo fake_fcinfo = &fake_fcinfo_data;
+
+#endif
+
+	FmgrInfo	flinfo;
+	TriggerData trigdata;
+	EventTriggerData etrigdata;
+	Trigger tg_trigger;
+	ReturnSetInfo rsinfo;
+	bool		fake_rtd;
+	profiler_profile *profile;
+	profiler_hashkey hk_function;
+	profiler_info pinfo;
+	profiler_hashkey hk;
+	profiler_iterator		pi;
+	bool		found_profile = false;
+
+	/* ensure correct complete content of hash key */
+	memset(&hk, 0, sizeof(profiler_hashkey));
+	hk.fn_oid = cinfo->fn_oid;
+	hk.db_oid = MyDatabaseId;
+	hk.fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
+	hk.fn_tid =  cinfo->proctuple->t_self;
+
+	memset(&pi, 0, sizeof(profiler_iterator));
+	pi.ri = ri;
+
+	/* copy of persistent profile, so no lock is held when result is formatted */
+	pi.pprofile = profiler_copy_persistent_profile(&hk);
+
+	plpgsql_check_setup_fcinfo(cinfo->proctuple,
+							   &flinfo,
+							   fake_fcinfo,
+							   &rsinfo,
+							   &trigdata,
+							   cinfo->relid,
+							   &etrigdata,
+							   cinfo->fn_oid,
+							   cinfo->rettype,
+							   cinfo->trigtype,
+							   &tg_trigger,
+							   &fake_rtd);
+
+	/* Get a compiled function */
+	function = plpgsql_compile(fake_fcinfo, false);
+
+	profiler_init_hashkey(&hk_function, function);
+	profile = (profiler_profile *) hash_search(profiler_HashTable,
+											 (void *) &hk_function,
+											 HASH_ENTER,
+											 &found_profile);
+
+	pinfo.profile = profile;
+
+	if (!found_profile)
+	{
+		MemoryContext oldcxt;
+
+		oldcxt = MemoryContextSwitchTo(profiler_mcxt);
+
+		profile->nstatements = 0;
+
+#if PG_VERSION_NUM < 120000
+
+		profile->stmts_map_size = PROFILER_MAP_INIT_SIZE;
+
+		profile->stmts_map = palloc0(profile->stmts_map_size * sizeof(profiler_map_entry));
+
+#else
+
+		/* stmtid is index to stmts_map, the statements are numbered from zero */
+		profile->stmts_map = palloc0(function->nstatements * sizeof(int));
+
+#endif
+
+		profile->entry_stmt = (PLpgSQL_stmt *) function->action;
+		profile->stmts_meta = NULL;
+		profile->stmts_meta_size = 0;
+		profile->pending_stmts = NULL;
+		profile->pending_stmtids = NULL;
+		profile->npending_stmtids = 0;
+		profile->pending_calls = 0;
+		memset(&profile->pending_func_stats, 0, sizeof(profiler_func_stats));
+		dlist_init(&profile->free_frames);
+		profile->nfree_frames = 0;
+
+		profiler_touch_stmt(&pinfo, (PLpgSQL_stmt *) function->action, NULL, NULL, 1, true, NULL);
+
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	profiler_touch_stmt(&pinfo, (PLpgSQL_stmt *) function->action, NULL, NULL, 1, false, &pi);
+}
+
+/*
+ * Prepare tuplestore with function profile
+ *
+ */
+void
+plpgsql_check_profiler_show_profile(plpgsql_check_result_info *ri,
+									plpgsql_check_info *cinfo)
+{
+	profiler_hashkey hk;
+	int			lineno = 1;
+	int			current_statement = 0;
+	profiler_persistent_profile *pprofile = NULL;
+	char	   *prosrc = cinfo->src;
+
+	/* ensure correct complete content of hash key */
+	memset(&hk, 0, sizeof(profiler_hashkey));
+	hk.fn_oid = cinfo->fn_oid;
+	hk.db_oid = MyDatabaseId;
+	hk.fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
+	hk.fn_tid =  cinfo->proctuple->t_self;
+
+	/* copy of persistent profile, so no lock is held when result is formatted */
+	pprofile = profiler_copy_persistent_profile(&hk);
+
+	/* iterate over source code rows */
+	while (*prosrc)
+	{
+		char	   *lineend = prosrc;
+		char	   *linebeg = prosrc;
+		int			stmt_lineno = -1;
+		int64		us_total = 0;
+		int64		us_self_total = 0;
+		int64		exec_count = 0;
+		Datum		max_time_array = (Datum) 0;
+		Datum		self_max_time_array = (Datum) 0;
+		Datum		percentile_time_arrays[PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES];
+		Datum		processed_rows_array = (Datum) 0;
+		int			cmds_on_row = 0;
+
+		/* find lineend */
+		while (*lineend != '\0' && *lineend != '\n')
+			lineend += 1;
+
+		if (*lineend == '\n')
+		{
+			*lineend = '\0';
+			prosrc = lineend + 1;
+		}
+		else
+			prosrc = lineend;
+
+		if (pprofile)
+		{
+			/* skip invisible statements if any */
+			while (current_statement < pprofile->nstatements &&
+				   pprofile->stmts[current_statement].lineno < lineno)
+				current_statement += 1;
+
+			if (current_statement < pprofile->nstatements &&
+				pprofile->stmts[current_statement].lineno == lineno)
+			{
+				ArrayBuildState *max_time_abs = NULL;
+				ArrayBuildState *self_max_time_abs = NULL;
+				ArrayBuildState *percentile_time_abs[PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES];
+				ArrayBuildState *processed_rows_abs = NULL;
+				int			i;
+
+				for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; i++)
+					percentile_time_abs[i] = NULL;
+
+#if PG_VERSION_NUM >= 90500
+
+				max_time_abs = initArrayResult(FLOAT8OID, CurrentMemoryContext, true);
+				self_max_time_abs = initArrayResult(FLOAT8OID, CurrentMemoryContext, true);
+				processed_rows_abs = initArrayResult(INT8OID, CurrentMemoryContext, true);
+
+				for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; i++)
+					percentile_time_abs[i] = initArrayResult(FLOAT8OID, CurrentMemoryContext, true);
+
+#endif
+
+				stmt_lineno = lineno;
+
+				/* try to collect all statements on the line */
+				while (current_statement < pprofile->nstatements &&
+					   pprofile->stmts[current_statement].lineno == lineno)
+				{
+					profiler_stmt_reduced *prstmt = &pprofile->stmts[current_statement];
+					int64		histogram[PROFILER_HISTOGRAM_BUCKETS];
+
+					us_total += profiler_counter_read(&prstmt->us_total);
+					us_self_total += profiler_counter_read(&prstmt->us_self_total);
+					exec_count += profiler_counter_read(&prstmt->exec_count);
+
+					cmds_on_row += 1;
+
+					max_time_abs = accumArrayResult(max_time_abs,
+													Float8GetDatum(profiler_counter_read(&prstmt->us_max) / 1000.0), false,
+													FLOAT8OID,
+													CurrentMemoryContext);
+
+					self_max_time_abs = accumArrayResult(self_max_time_abs,
+														 Float8GetDatum(profiler_counter_read(&prstmt->us_self_max) / 1000.0), false,
+														 FLOAT8OID,
+														 CurrentMemoryContext);
+
+					profiler_histogram_read(prstmt->histogram, histogram);
+
+					for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; i++)
+					{
+						double		percentile_time;
+
+						percentile_time = profiler_histogram_percentile(histogram,
+																		profiler_counter_read(&prstmt->us_max),
+																		profiler_percentiles[i]);
+
+						/* the percentile is unknown, when timing was not enabled */
+						percentile_time_abs[i] = accumArrayResult(percentile_time_abs[i],
+																  Float8GetDatum(percentile_time / 1000.0),
+																  percentile_time < 0.0,
+																  FLOAT8OID,
+																  CurrentMemoryContext);
+					}
+
+					processed_rows_abs = accumArrayResult(processed_rows_abs,
+														 Int64GetDatum(profiler_counter_read(&prstmt->rows)), false,
+														 INT8OID,
+														 CurrentMemoryContext);
+
+					current_statement += 1;
+				}
+
+				max_time_array = makeArrayResult(max_time_abs, CurrentMemoryContext);
+				self_max_time_array = makeArrayResult(self_max_time_abs, CurrentMemoryContext);
+
+				for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; i++)
+					percentile_time_arrays[i] = makeArrayResult(percentile_time_abs[i], CurrentMemoryContext);
+
+				processed_rows_array = makeArrayResult(processed_rows_abs, CurrentMemoryContext);
+			}
+		}
+
+		plpgsql_check_put_profile(ri,
+							   lineno,
+							   stmt_lineno,
+							   cmds_on_row,
+							   exec_count,
+							   us_total,
+							   max_time_array,
+							   us_self_total,
+							   self_max_time_array,
+							   percentile_time_arrays,
+							   processed_rows_array,
+							   linebeg);
+
+		lineno += 1;
+	}
+}
+
+/*
+ * Callbacks used for reading of all profiles and edges. They should
+ * only copy counters, because the lock of partition can be held.
+ */
+typedef void (*profiler_profile_callback) (profiler_persistent_profile *pprofile, void *arg);
+typedef void (*profiler_edge_callback) (profiler_edge_key *key, int64 calls, int64 total_time, int64 self_time, void *arg);
+
+/*
+ * Calls callback for every persistent profile of current database. The
+ * shared profiles are read by partitions, and only the lock of currently
+ * read partition is held, so creating of profiles in other partitions
+ * is not blocked.
+ */
+static void
+profiler_foreach_profile(profiler_profile_callback callback, void *arg)
+{
+	profiler_persistent_profile *pprofile;
+
+	if (shared_profiler_profiles_HashTable)
+	{
+		int			i;
+
+		for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS; i++)
+		{
+			dlist_iter	iter;
+
+			LWLockAcquire(profiler_ss->locks[i], LW_SHARED);
+
+			dlist_foreach(iter, &profiler_ss->profiles[i])
+			{
+				pprofile = dlist_container(profiler_persistent_profile, node, iter.cur);
+
+				if (pprofile->key.db_oid == MyDatabaseId)
+					callback(pprofile, arg);
+			}
+
+			LWLockRelease(profiler_ss->locks[i]);
+		}
+	}
+	else
+	{
+		HASH_SEQ_STATUS hash_seq;
+
+		hash_seq_init(&hash_seq, profiler_profiles_HashTable);
+
+		while ((pprofile = (profiler_persistent_profile *) hash_seq_search(&hash_seq)) != NULL)
+			callback(pprofile, arg);
+	}
+}
+
+/*
+ * Calls callback for every edge of call graph of current database. The
+ * shared edges are read by partitions like profiles.
+ */
+static void
+profiler_foreach_edge(profiler_edge_callback callback, void *arg)
+{
+	if (shared_profiler_edges_HashTable)
+	{
+		int			i;
+
+		for (i = 0; i < PLPGSQL_CHECK_PROFILER_NUM_PARTITIONS; i++)
+		{
+			dlist_iter	iter;
+
+			LWLockAcquire(profiler_ss->locks[i], LW_SHARED);
+
+			dlist_foreach(iter, &profiler_ss->edges[i])
+			{
+				profiler_shared_edge *edge = dlist_container(profiler_shared_edge, node, iter.cur);
+				int64		calls;
+				int64		total_time;
+				int64		self_time;
+
+				if (edge->key.caller.db_oid != MyDatabaseId)
+					continue;
+
+				SpinLockAcquire(&edge->mutex);
+				calls = edge->calls;
+				total_time = edge->total_time;
+				self_time = edge->self_time;
+				SpinLockRelease(&edge->mutex);
+
+				callback(&edge->key, calls, total_time, self_time, arg);
+			}
+
+			LWLockRelease(profiler_ss->locks[i]);
+		}
+	}
+	else
+	{
+		HASH_SEQ_STATUS hash_seq;
+		profiler_edge *edge;
+
+		hash_seq_init(&hash_seq, profiler_edges_HashTable);
+
+		while ((edge = (profiler_edge *) hash_seq_search(&hash_seq)) != NULL)
+			callback(&edge->key, edge->calls, edge->total_time, edge->self_time, arg);
+	}
+}
+
+/*
+ * Copy of statistics of function used for displaying
+ */
+typedef struct profiler_func_stats_copy
+{
+	Oid			fn_oid;
+	TimestampTz	stats_since;
+	profiler_func_stats stats;
+} profiler_func_stats_copy;
+
+static int
+profiler_func_stats_cmp_total_desc(const void *a, const void *b)
+{
+	const profiler_func_stats_copy *s1 = (const profiler_func_stats_copy *) a;
+	const profiler_func_stats_copy *s2 = (const profiler_func_stats_copy *) b;
+
+	if (s1->stats.total_time != s2->stats.total_time)
+		return s1->stats.total_time < s2->stats.total_time ? 1 : -1;
+
+	return s1->fn_oid > s2->fn_oid ? 1 : (s1->fn_oid < s2->fn_oid ? -1 : 0);
+}
+
+typedef struct profiler_func_stats_copies
+{
+	profiler_func_stats_copy *items;
+	int			nitems;
+	int			size;
+} profiler_func_stats_copies;
+
+static void
+profiler_copy_func_stats(profiler_persistent_profile *pprofile, void *arg)
+{
+	profiler_func_stats_copies *copies = (profiler_func_stats_copies *) arg;
+	profiler_func_stats_copy *copy;
+
+	if (copies->nitems >= copies->size)
+	{
+		copies->size *= 2;
+		copies->items = repalloc(copies->items,
+								 copies->size * sizeof(profiler_func_stats_copy));
+	}
+
+	copy = &copies->items[copies->nitems++];
+
+	copy->fn_oid = pprofile->key.fn_oid;
+
+	SpinLockAcquire(&pprofile->stats_mutex);
+	copy->stats_since = pprofile->stats_since;
+	copy->stats = pprofile->func_stats;
+	SpinLockRelease(&pprofile->stats_mutex);
+}
+
+/*
+ * Displays statistics of calls of all profiled functions of current
+ * database. The statistics are copied under locks of partitions, and
+ * the result is prepared (and sorted by total time) without lock.
+ */
+void
+plpgsql_check_profiler_show_functions_all(plpgsql_check_result_info *ri)
+{
+	profiler_func_stats_copies data;
+	profiler_func_stats_copy *copies;
+	TimestampTz	now;
+	int			ncopies;
+	int			i,
+				j;
+
+	/* show counters of this session too */
+	if (shared_profiler_profiles_HashTable)
+		profiler_flush_pending();
+
+	data.size = 64;
+	data.nitems = 0;
+	data.items = palloc(data.size * sizeof(profiler_func_stats_copy));
+
+	profiler_foreach_profile(profiler_copy_func_stats, &data);
+
+	copies = data.items;
+	ncopies = data.nitems;
+
+	qsort(copies, ncopies, sizeof(profiler_func_stats_copy),
+		  profiler_func_stats_cmp_total_desc);
+
+	now = GetCurrentTimestamp();
+
+	for (i = 0; i < ncopies; i++)
+	{
+		profiler_func_stats *stats = &copies[i].stats;
+		double		percentile_times[PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES];
+		double		stddev_time = -1.0;
+		double		calls_per_sec = -1.0;
+		long		secs;
+		int			microsecs;
+
+		for (j = 0; j < PLPGSQL_CHECK_PROFILER_NUM_PERCENTILES; j++)
+			percentile_times[j] = profiler_histogram_percentile(stats->histogram,
+																stats->max_time,
+																profiler_percentiles[j]);
+
+		if (stats->timed_calls > 1)
+			stddev_time = sqrt(stats->sum_var_time / (stats->timed_calls - 1));
+		else if (stats->timed_calls == 1)
+			stddev_time = 0.0;
+
+		TimestampDifference(copies[i].stats_since, now, &secs, &microsecs);
+
+		if (secs > 0 || microsecs > 0)
+			calls_per_sec = stats->calls / (secs + microsecs / 1000000.0);
+
+		plpgsql_check_put_profiler_functions_all(ri,
+												 copies[i].fn_oid,
+												 stats->calls,
+												 stats->total_time,
+												 stats->timed_calls > 0 ? stats->mean_time : -1.0,
+												 stddev_time,
+												 stats->timed_calls > 0 ? stats->min_time : -1.0,
+												 stats->timed_calls > 0 ? stats->max_time : -1.0,
+												 percentile_times,
+												 calls_per_sec,
+												 copies[i].stats_since);
+	}
+
+	pfree(copies);
+}
+
+
+/*
+ * Copy of counters of statement used for top statements report
+ */
+typedef struct profiler_top_stmt
+{
+	Oid			fn_oid;
+	int			stmtid;
+	int			lineno;
+	int64		exec_count;
+	int64		us_total;
+	int64		us_max;
+	int64		rows;
+} profiler_top_stmt;
+
+static inline int64
+profiler_top_stmt_key(profiler_top_stmt *tstmt, int order_by)
+{
+	switch (order_by)
+	{
+		case PLPGSQL_CHECK_PROFILER_ORDER_BY_MAX_TIME:
+			return tstmt->us_max;
+		case PLPGSQL_CHECK_PROFILER_ORDER_BY_EXEC_COUNT:
+			return tstmt->exec_count;
+		default:
+			return tstmt->us_total;
+	}
+}
+
+/*
+ * Compare function for top statements - the statement with higher
+ * key is "less". The order is stable against function oid and stmtid.
+ */
+static int
+profiler_top_stmt_cmp(profiler_top_stmt *s1, profiler_top_stmt *s2, int order_by)
+{
+	int64		key1 = profiler_top_stmt_key(s1, order_by);
+	int64		key2 = profiler_top_stmt_key(s2, order_by);
+
+	if (key1 != key2)
+		return key1 < key2 ? 1 : -1;
+
+	if (s1->fn_oid != s2->fn_oid)
+		return s1->fn_oid > s2->fn_oid ? 1 : -1;
+
+	return s1->stmtid > s2->stmtid ? 1 : (s1->stmtid < s2->stmtid ? -1 : 0);
+}
+
+/*
+ * The top statements are collected in binary heap, where the root
+ * is the "biggest" (the worst) statement of heap.
+ */
+static void
+profiler_top_stmts_sift_down(profiler_top_stmt *heap, int nitems, int i, int order_by)
+{
+	for (;;)
+	{
+		int			left = 2 * i + 1;
+		int			right = left + 1;
+		int			largest = i;
+		profiler_top_stmt tmp;
+
+		if (left < nitems && profiler_top_stmt_cmp(&heap[left], &heap[largest], order_by) > 0)
+			largest = left;
+		if (right < nitems && profiler_top_stmt_cmp(&heap[right], &heap[largest], order_by) > 0)
+			largest = right;
+
+		if (largest == i)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[largest];
+		heap[largest] = tmp;
+
+		i = largest;
+	}
+}
+
+static void
+profiler_top_stmts_sift_up(profiler_top_stmt *heap, int i, int order_by)
+{
+	while (i > 0)
+	{
+		int			parent = (i - 1) / 2;
+		profiler_top_stmt tmp;
+
+		if (profiler_top_stmt_cmp(&heap[i], &heap[parent], order_by) <= 0)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+
+		i = parent;
+	}
+}
+
+typedef struct profiler_top_stmts
+{
+	profiler_top_stmt *heap;
+	int			nitems;
+	int			size;
+	int			n;
+	int			order_by;
+} profiler_top_stmts;
+
+static void
+profiler_copy_top_stmts(profiler_persistent_profile *pprofile, void *arg)
+{
+	profiler_top_stmts *top = (profiler_top_stmts *) arg;
+	bool		shared_profiles = shared_profiler_profiles_HashTable != NULL;
+	int			i;
+
+	if (shared_profiles)
+		profiler_stmts_lock(pprofile);
+
+	for (i = 0; i < pprofile->nstatements; i++)
+	{
+		profiler_stmt_reduced *prstmt = &pprofile->stmts[i];
+		profiler_top_stmt tstmt;
+
+		tstmt.exec_count = profiler_counter_read(&prstmt->exec_count);
+
+		/* ignore not executed and invisible statements */
+		if (tstmt.exec_count == 0 || prstmt->lineno <= 0)
+			continue;
+
+		tstmt.fn_oid = pprofile->key.fn_oid;
+		tstmt.stmtid = i;
+		tstmt.lineno = prstmt->lineno;
+		tstmt.us_total = profiler_counter_read(&prstmt->us_total);
+		tstmt.us_max = profiler_counter_read(&prstmt->us_max);
+		tstmt.rows = profiler_counter_read(&prstmt->rows);
+
+		if (top->nitems < top->n)
+		{
+			/* the heap is enlarged only when it is necessary */
+			if (top->nitems >= top->size)
+			{
+				/* memory should not be allocated under spinlock */
+				if (shared_profiles)
+					profiler_stmts_unlock(pprofile);
+
+				top->size = Min(top->size * 2, top->n);
+				top->heap = repalloc(top->heap, top->size * sizeof(profiler_top_stmt));
+
+				if (shared_profiles)
+					profiler_stmts_lock(pprofile);
+			}
+
+			top->heap[top->nitems] = tstmt;
+			profiler_top_stmts_sift_up(top->heap, top->nitems++, top->order_by);
+		}
+		else if (profiler_top_stmt_cmp(&tstmt, &top->heap[0], top->order_by) < 0)
+		{
+			/* replace the worst statement of heap */
+			top->heap[0] = tstmt;
+			profiler_top_stmts_sift_down(top->heap, top->nitems, 0, top->order_by);
+		}
+	}
+
+	if (shared_profiles)
+		profiler_stmts_unlock(pprofile);
+}
+
+/*
+ * Displays top n statements of all profiled functions of current database.
+ * Only counters are copied under locks of partitions (to small binary heap),
+ * the result is sorted and displayed after locks are released.
+ */
+void
+plpgsql_check_profiler_show_top_statements(plpgsql_check_result_info *ri,
+										   int n,
+										   int order_by)
+{
+	profiler_top_stmts top;
+	profiler_top_stmt *heap;
+	int			nitems;
+	int			i;
+
+	if (n <= 0)
+		return;
+
+	/* show counters of this session too */
+	if (shared_profiler_profiles_HashTable)
+		profiler_flush_pending();
+
+	top.n = n;
+	top.order_by = order_by;
+	top.nitems = 0;
+	top.size = Min(n, 64);
+	top.heap = palloc(top.size * sizeof(profiler_top_stmt));
+
+	profiler_foreach_profile(profiler_copy_top_stmts, &top);
+
+	heap = top.heap;
+	nitems = top.nitems;
+
+	/* heap sort - the worst statement is moved to the end */
+	for (i = nitems - 1; i > 0; i--)
+	{
+		profiler_top_stmt tmp = heap[0];
+
+		heap[0] = heap[i];
+		heap[i] = tmp;
+
+		profiler_top_stmts_sift_down(heap, i, 0, order_by);
+	}
+
+	for (i = 0; i < nitems; i++)
+		plpgsql_check_put_profiler_top_statement(ri,
+												 heap[i].fn_oid,
+												 heap[i].stmtid,
+												 heap[i].lineno,
+												 heap[i].exec_count,
+												 heap[i].us_total,
+												 heap[i].us_max,
+												 heap[i].rows);
+
+	pfree(heap);
+}
+
+/*
+ * Copy of edge of call graph used for sorting
+ */
+typedef struct profiler_edge_copy
+{
+	profiler_edge_key key;
+	int			caller_lineno;
+	int64		calls;
+	int64		total_time;
+	int64		self_time;
+} profiler_edge_copy;
+
+static int
+profiler_edge_cmp_total_desc(const void *a, const void *b)
+{
+	const profiler_edge_copy *e1 = (const profiler_edge_copy *) a;
+	const profiler_edge_copy *e2 = (const profiler_edge_copy *) b;
+
+	if (e1->total_time != e2->total_time)
+		return e1->total_time < e2->total_time ? 1 : -1;
+
+	if (e1->key.caller_stmtid != e2->key.caller_stmtid)
+		return e1->key.caller_stmtid < e2->key.caller_stmtid ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Returns line of caller's statement or -1, when profile of caller
+ * is not available. The shared profile is searched under lock of
+ * its partition.
  */
+static int
+profiler_edge_caller_lineno(profiler_edge_key *key)
+{
+	profiler_persistent_profile *pprofile;
+	HTAB	   *profiles;
+	uint32		hashcode;
+	LWLock	   *lock = NULL;
+	int			result = -1;
+
+	if (shared_profiler_profiles_HashTable)
+	{
+		profiles = shared_profiler_profiles_HashTable;
+		hashcode = get_hash_value(profiles, &key->caller);
+		lock = profiler_partition_lock(hashcode);
+
+		LWLockAcquire(lock, LW_SHARED);
+	}
+	else
+	{
+		profiles = profiler_profiles_HashTable;
+		hashcode = get_hash_value(profiles, &key->caller);
+	}
+
+	pprofile = (profiler_persistent_profile *) hash_search_with_hash_value(profiles,
+																		   (void *) &key->caller,
+																		   hashcode,
+																		   HASH_FIND,
+																		   NULL);
+
+	if (pprofile &&
+		profiler_is_same_version(&pprofile->key, &key->caller) &&
+		key->caller_stmtid < pprofile->nstatements)
+		result = pprofile->stmts[key->caller_stmtid].lineno;
+
+	if (lock)
+		LWLockRelease(lock);
+
+	return result;
+}
+
+typedef struct profiler_edge_copies
+{
+	profiler_edge_copy *items;
+	int			nitems;
+	int			size;
+} profiler_edge_copies;
+
 static void
-profiler_chunks_HashTableInit(void)
+profiler_copy_edge(profiler_edge_key *key,
+				   int64 calls,
+				   int64 total_time,
+				   int64 self_time,
+				   void *arg)
 {
-	HASHCTL		ctl;
+	profiler_edge_copies *copies = (profiler_edge_copies *) arg;
+	profiler_edge_copy *ecopy;
 
-	Assert(profiler_chunks_HashTable == NULL);
+	if (copies->nitems >= copies->size)
+	{
+		copies->size *= 2;
+		copies->items = repalloc(copies->items,
+								 copies->size * sizeof(profiler_edge_copy));
+	}
 
-	memset(&ctl, 0, sizeof(ctl));
-	ctl.keysize = sizeof(profiler_hashkey);
-	ctl.entrysize = sizeof(profiler_stmt_chunk);
-	ctl.hcxt = profiler_mcxt;
-	ctl.hash = tag_hash;
-	profiler_chunks_HashTable = hash_create("plpgsql_check function profiler local chunks",
-									FUNCS_PER_USER,
-									&ctl,
-									HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	ecopy = &copies->items[copies->nitems++];
+
+	ecopy->key = *key;
+	ecopy->caller_lineno = -1;
+	ecopy->calls = calls;
+	ecopy->total_time = total_time;
+	ecopy->self_time = self_time;
+}
+
+/*
+ * Copy edges of call graph of current database. The edges are copied
+ * under locks of partitions.
+ */
+static profiler_edge_copy *
+profiler_copy_edges(int *nedges)
+{
+	profiler_edge_copies copies;
+
+	copies.size = 64;
+	copies.nitems = 0;
+	copies.items = palloc(copies.size * sizeof(profiler_edge_copy));
+
+	profiler_foreach_edge(profiler_copy_edge, &copies);
+
+	*nedges = copies.nitems;
+
+	return copies.items;
 }
 
+/*
+ * Prepare tuplestore with edges of call graph of current database
+ * sorted by total time of calls.
+ */
 void
-plpgsql_check_profiler_init_hash_tables(void)
+plpgsql_check_profiler_show_call_graph(plpgsql_check_result_info *ri)
 {
-	if (profiler_mcxt)
-	{
-		MemoryContextReset(profiler_mcxt);
+	profiler_edge_copy *edges;
+	int			nedges;
+	int			i;
 
-		profiler_HashTable = NULL;
-		profiler_chunks_HashTable = NULL;
-	}
-	else
-	{
-		profiler_mcxt = AllocSetContextCreate(TopMemoryContext,
-												"plpgsql_check - profiler context",
-												ALLOCSET_DEFAULT_MINSIZE,
-												ALLOCSET_DEFAULT_INITSIZE,
-												ALLOCSET_DEFAULT_MAXSIZE);
-	}
+	/* show counters of this session too */
+	if (shared_profiler_edges_HashTable)
+		profiler_flush_pending();
 
-	profiler_localHashTableInit();
-	profiler_chunks_HashTableInit();
+	edges = profiler_copy_edges(&nedges);
+
+	/* the profiles of callers are in other partitions */
+	for (i = 0; i < nedges; i++)
+		edges[i].caller_lineno = profiler_edge_caller_lineno(&edges[i].key);
+
+	if (nedges > 1)
+		qsort(edges, nedges, sizeof(profiler_edge_copy), profiler_edge_cmp_total_desc);
+
+	for (i = 0; i < nedges; i++)
+		plpgsql_check_put_profiler_call_graph_edge(ri,
+												   edges[i].key.caller.fn_oid,
+												   edges[i].key.caller_stmtid,
+												   edges[i].caller_lineno,
+												   edges[i].key.callee_oid,
+												   edges[i].calls,
+												   edges[i].total_time,
+												   edges[i].self_time);
+
+	pfree(edges);
 }
 
 /*
- * profiler_touch_stmt - iterator over plpgsql statements.
- *
- * This function is designed for two different purposes:
- *
- *   a) assign unique id to every plpgsql statement and
- *      create statement -> id mapping
- *   b) iterate over all commends and finalize total time
- *      as measured total time substract child total time.
- *   c) iterate over all commands and prepare result for
- *      plpgsql_profiler_function_statements_tb function.
- *
+ * Nodes of flame graph are built from profiles and from edges of call graph.
+ * The self time of statements doesn't include time of nested profiled calls.
+ * The profile of function has complete time of calls (from any caller), so
+ * the values of statements are divided between callers by number of calls.
+ * Only one profile (with most calls) is used for function (the profiles of
+ * older versions of function are ignored).
  */
-static void
-profiler_touch_stmt(profiler_info *pinfo,
-					PLpgSQL_stmt *stmt,
-					PLpgSQL_stmt *parent_stmt,
-					const char *parent_note,
-					int block_num,
-					bool generate_map,
-					bool finalize_profile,
-					int64 *nested_us_total,
-					profiler_iterator *pi)
+#define PROFILER_FLAMEGRAPH_MAX_DEPTH		64
+
+/* the paths with smaller part of calls are not displayed */
+#define PROFILER_FLAMEGRAPH_MIN_SHARE		1e-6
+
+typedef struct profiler_fg_edge
 {
-	int64		us_total = 0;
-	profiler_profile *profile = pinfo->profile;
-	profiler_stmt *pstmt = NULL;
+	int			caller_stmtid;
+	int64		calls;
+	struct profiler_fg_node *callee;
+} profiler_fg_edge;
 
-	if (pi)
-	{
-		int		stmtid = profiler_get_stmtid(profile, stmt);
-		int		parent_stmtid = parent_stmt ? profiler_get_stmtid(profile, parent_stmt) : -1;
-		profiler_stmt_reduced *pstmt;
+typedef struct profiler_fg_node
+{
+	Oid			fn_oid;				/* hash key */
+	profiler_hashkey key;
+	int64		calls;
+	int64		root_calls;			/* calls without profiled caller */
+	int			nstatements;
+	int		   *linenos;
+	int64	   *values;				/* self time or execution count of statements */
+	char	   *name;
+	List	   *edges;
+} profiler_fg_node;
 
-		pstmt = get_stmt_profile_next(pi);
+/*
+ * Writes stacks of statements of node with positive value to result, and
+ * continue to called functions. The prefix holds the stack of callers.
+ */
+static void
+profiler_flamegraph_walk(plpgsql_check_result_info *ri,
+						 profiler_fg_node *node,
+						 double share,
+						 int depth,
+						 StringInfo prefix)
+{
+	int			prefix_len = prefix->len;
+	ListCell   *lc;
+	int			i;
 
-		plpgsql_check_put_profile_statement(pi->ri,
-											stmtid,
-											parent_stmtid,
-											parent_note,
-											block_num,
-											stmt->lineno,
-											pstmt ? pstmt->exec_count : 0,
-											pstmt ? pstmt->us_total : 0.0,
-											pstmt ? pstmt->us_max : 0.0,
-											pstmt ? pstmt->rows : 0,
-											(char *) plpgsql_stmt_typename(stmt));
+	check_stack_depth();
+	CHECK_FOR_INTERRUPTS();
 
-		parent_note = NULL;
-	}
-	else if (generate_map)
-	{
-		profiler_update_map(profile, stmt);
-	}
-	else if (finalize_profile)
+	for (i = 0; i < node->nstatements; i++)
 	{
-		int stmtid = profiler_get_stmtid(profile, stmt);
+		int64		value;
 
-		*nested_us_total = 0;
+		if (node->values[i] <= 0)
+			continue;
 
-		pstmt = &pinfo->stmts[stmtid];
-		pstmt->lineno = stmt->lineno;
+		value = (int64) rint(node->values[i] * share);
+		if (value <= 0)
+			continue;
+
+		appendStringInfo(prefix, "%s:%d " INT64_FORMAT, node->name, node->linenos[i], value);
+		plpgsql_check_put_profiler_flamegraph_line(ri, prefix->data, prefix->len);
+
+		prefix->len = prefix_len;
+		prefix->data[prefix_len] = '\0';
 	}
 
-	switch (PLPGSQL_STMT_TYPES stmt->cmd_type)
+	if (depth >= PROFILER_FLAMEGRAPH_MAX_DEPTH)
+		return;
+
+	foreach(lc, node->edges)
 	{
-		case PLPGSQL_STMT_BLOCK:
-			{
-				PLpgSQL_stmt_block *stmt_block = (PLpgSQL_stmt_block *) stmt;
+		profiler_fg_edge *edge = (profiler_fg_edge *) lfirst(lc);
+		double		callee_share;
 
-				profiler_touch_stmts(pinfo,
-									 stmt_block->body,
-									 stmt,
-									 "body",
-									 generate_map,
-									 finalize_profile,
-									 &us_total,
-									 pi);
+		if (edge->callee->calls <= 0)
+			continue;
 
-				if (finalize_profile)
-					*nested_us_total += us_total;
+		callee_share = share * edge->calls / edge->callee->calls;
+		if (callee_share < PROFILER_FLAMEGRAPH_MIN_SHARE)
+			continue;
 
-				if (stmt_block->exceptions)
-				{
-					ListCell *lc;
-					char	buffer[20];
-					int		n = 0;
+		appendStringInfo(prefix, "%s:%d;", node->name, node->linenos[edge->caller_stmtid]);
 
-					foreach(lc, stmt_block->exceptions->exc_list)
-					{
-						sprintf(buffer, "exception %d", ++n);
+		profiler_flamegraph_walk(ri, edge->callee, callee_share, depth + 1, prefix);
 
-						profiler_touch_stmts(pinfo,
-											 ((PLpgSQL_exception *) lfirst(lc))->action,
-											 stmt,
-											 (const char *) buffer,
-											 generate_map,
-											 finalize_profile,
-											 &us_total,
-											 pi);
+		prefix->len = prefix_len;
+		prefix->data[prefix_len] = '\0';
+	}
+}
 
-						if (finalize_profile)
-							*nested_us_total += us_total;
-					}
-				}
+typedef struct profiler_fg_nodes
+{
+	HTAB	   *nodes;
+	bool		use_time;
+} profiler_fg_nodes;
 
-				if (finalize_profile)
-				{
-					pstmt->us_total -= *nested_us_total;
-
-					/*
-					 * the max time can be calculated only when this node
-					 * was executed once!
-					 */
-					if (pstmt->exec_count == 1)
-						pstmt->us_max = pstmt->us_total;
-					else
-						pstmt->us_max = 0;
-
-					*nested_us_total += pstmt->us_total;
-				}
-			}
-			break;
+/*
+ * Copy statements of profile to node of flame graph
+ */
+static void
+profiler_copy_fg_node(profiler_persistent_profile *pprofile, void *arg)
+{
+	profiler_fg_nodes *data = (profiler_fg_nodes *) arg;
+	profiler_fg_node *node;
+	int64		calls;
+	bool		found;
+	int			i;
 
-		case PLPGSQL_STMT_IF:
-			{
-				PLpgSQL_stmt_if *stmt_if = (PLpgSQL_stmt_if *) stmt;
-				ListCell *lc;
+	SpinLockAcquire(&pprofile->stats_mutex);
+	calls = pprofile->func_stats.calls;
+	SpinLockRelease(&pprofile->stats_mutex);
 
-				profiler_touch_stmts(pinfo,
-									 stmt_if->then_body,
-									 stmt,
-									 "then body",
-									 generate_map,
-									 finalize_profile,
-									 &us_total,
-									 pi);
+	node = (profiler_fg_node *) hash_search(data->nodes,
+											(void *) &pprofile->key.fn_oid,
+											HASH_ENTER,
+											&found);
 
-				if (finalize_profile)
-					*nested_us_total += us_total;
+	if (found)
+	{
+		/* only the profile with most calls is used */
+		if (node->calls >= calls)
+			return;
 
-				foreach(lc, stmt_if->elsif_list)
-				{
-					int		n = 0;
-					char buffer[20];
+		pfree(node->linenos);
+		pfree(node->values);
+	}
 
-					sprintf(buffer, "elsif %d", ++n);
-					profiler_touch_stmts(pinfo,
-										 ((PLpgSQL_if_elsif *) lfirst(lc))->stmts,
-										 stmt,
-										 (const char *) buffer,
-										 generate_map,
-										 finalize_profile,
-										 &us_total,
-										 pi);
+	node->key = pprofile->key;
+	node->calls = calls;
+	node->root_calls = calls;
+	node->nstatements = pprofile->nstatements;
+	node->linenos = palloc(pprofile->nstatements * sizeof(int));
+	node->values = palloc(pprofile->nstatements * sizeof(int64));
+	node->name = NULL;
+	node->edges = NIL;
 
-					if (finalize_profile)
-						*nested_us_total += us_total;
-				}
+	if (shared_profiler_profiles_HashTable)
+		profiler_stmts_lock(pprofile);
 
-				profiler_touch_stmts(pinfo,
-									 stmt_if->else_body,
-									 stmt,
-									 "else body",
-									 generate_map,
-									 finalize_profile,
-									 &us_total,
-									 pi);
+	for (i = 0; i < pprofile->nstatements; i++)
+	{
+		profiler_stmt_reduced *prstmt = &pprofile->stmts[i];
 
-				if (finalize_profile)
-					*nested_us_total += us_total;
+		node->linenos[i] = prstmt->lineno;
 
-				if (finalize_profile)
-				{
-					pstmt->us_total -= *nested_us_total;
-
-					/*
-					 * the max time can be calculated only when this node
-					 * was executed once!
-					 */
-					if (pstmt->exec_count == 1)
-						pstmt->us_max = pstmt->us_total;
-					else
-						pstmt->us_max = 0;
-
-					*nested_us_total += pstmt->us_total;
-				}
-			}
-			break;
+		if (data->use_time)
+			node->values[i] = profiler_counter_read(&prstmt->us_self_total);
+		else
+			node->values[i] = profiler_counter_read(&prstmt->exec_count);
+	}
 
-		case PLPGSQL_STMT_CASE:
-			{
-				PLpgSQL_stmt_case *stmt_case = (PLpgSQL_stmt_case *) stmt;
-				ListCell *lc;
+	if (shared_profiler_profiles_HashTable)
+		profiler_stmts_unlock(pprofile);
+}
 
-				foreach(lc, stmt_case->case_when_list)
-				{
-					char	buffer[20];
-					int		n = 0;
+/*
+ * Prepare tuplestore with flame graph of profiled functions of current
+ * database in collapsed stack format. The values are self times of
+ * statements in microseconds or execution counts of statements. Every
+ * stack is stored as one row, so the result is not limited by size of
+ * one string.
+ */
+void
+plpgsql_check_profiler_show_flamegraph(plpgsql_check_result_info *ri,
+									   bool use_time)
+{
+	HASH_SEQ_STATUS hash_seq;
+	HASHCTL		ctl;
+	HTAB	   *nodes;
+	profiler_fg_nodes data;
+	profiler_fg_node *node;
+	profiler_edge_copy *edges;
+	int			nedges;
+	StringInfoData prefix;
+	int			i;
 
-					sprintf(buffer, "case when %d", ++n);
-					profiler_touch_stmts(pinfo,
-										 ((PLpgSQL_case_when *) lfirst(lc))->stmts,
-										 stmt,
-										 (const char *) buffer,
-										 generate_map,
-										 finalize_profile,
-										 &us_total,
-										 pi);
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(profiler_fg_node);
+	ctl.hcxt = CurrentMemoryContext;
+	ctl.hash = tag_hash;
+	nodes = hash_create("plpgsql_check profiler flame graph",
+						FUNCS_PER_USER,
+						&ctl,
+						HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 
-					if (finalize_profile)
-						*nested_us_total += us_total;
-				}
+	/* show counters of this session too */
+	if (shared_profiler_profiles_HashTable)
+		profiler_flush_pending();
 
-				profiler_touch_stmts(pinfo,
-									 stmt_case->else_stmts,
-									 stmt,
-									 "case else",
-									 generate_map,
-									 finalize_profile,
-									 &us_total,
-									 pi);
+	/* copy counters, the result is formatted without locks */
+	data.nodes = nodes;
+	data.use_time = use_time;
 
-				if (finalize_profile)
-					*nested_us_total += us_total;
+	profiler_foreach_profile(profiler_copy_fg_node, &data);
 
-				if (finalize_profile)
-				{
-					pstmt->us_total -= *nested_us_total;
-
-					/*
-					 * the max time can be calculated only when this node
-					 * was executed once!
-					 */
-					if (pstmt->exec_count == 1)
-						pstmt->us_max = pstmt->us_total;
-					else
-						pstmt->us_max = 0;
-
-					*nested_us_total += pstmt->us_total;
-				}
-			}
-			break;
+	edges = profiler_copy_edges(&nedges);
 
-		case PLPGSQL_STMT_LOOP:
-		case PLPGSQL_STMT_FORI:
-		case PLPGSQL_STMT_FORS:
-		case PLPGSQL_STMT_FORC:
-		case PLPGSQL_STMT_DYNFORS:
-		case PLPGSQL_STMT_FOREACH_A:
-			{
-				List   *stmts;
+	/*
+	 * Connect nodes by edges. The calls from other functions are not
+	 * calls from root of graph.
+	 */
+	for (i = 0; i < nedges; i++)
+	{
+		profiler_edge_copy *ecopy = &edges[i];
+		profiler_fg_node *caller;
+		profiler_fg_node *callee;
+		profiler_fg_edge *edge;
+
+		caller = (profiler_fg_node *) hash_search(nodes,
+												  (void *) &ecopy->key.caller.fn_oid,
+												  HASH_FIND,
+												  NULL);
+		callee = (profiler_fg_node *) hash_search(nodes,
+												  (void *) &ecopy->key.callee_oid,
+												  HASH_FIND,
+												  NULL);
+
+		if (!caller || !callee ||
+			memcmp(&caller->key, &ecopy->key.caller, sizeof(profiler_hashkey)) != 0 ||
+			ecopy->key.caller_stmtid >= caller->nstatements)
+			continue;
+
+		callee->root_calls -= ecopy->calls;
+
+		edge = palloc(sizeof(profiler_fg_edge));
+		edge->caller_stmtid = ecopy->key.caller_stmtid;
+		edge->calls = ecopy->calls;
+		edge->callee = callee;
+
+		caller->edges = lappend(caller->edges, edge);
+	}
 
-				switch (PLPGSQL_STMT_TYPES stmt->cmd_type)
-				{
-					case PLPGSQL_STMT_LOOP:
-						stmts = ((PLpgSQL_stmt_while *) stmt)->body;
-						break;
-					case PLPGSQL_STMT_FORI:
-						stmts = ((PLpgSQL_stmt_fori *) stmt)->body;
-						break;
-					case PLPGSQL_STMT_FORS:
-						stmts = ((PLpgSQL_stmt_fors *) stmt)->body;
-						break;
-					case PLPGSQL_STMT_FORC:
-						stmts = ((PLpgSQL_stmt_forc *) stmt)->body;
-						break;
-					case PLPGSQL_STMT_DYNFORS:
-						stmts = ((PLpgSQL_stmt_dynfors *) stmt)->body;
-						break;
-					case PLPGSQL_STMT_FOREACH_A:
-						stmts = ((PLpgSQL_stmt_foreach_a *) stmt)->body;
-						break;
-					default:
-						stmts = NIL;
-						break;
-				}
+	pfree(edges);
 
-				profiler_touch_stmts(pinfo,
-								 stmts,
-								 stmt,
-								 "loop body",
-								 generate_map,
-								 finalize_profile,
-								 &us_total,
-								 pi);
+	/* names of functions requires catalog access, so locks should be released */
+	hash_seq_init(&hash_seq, nodes);
 
-				if (finalize_profile)
-					*nested_us_total += us_total;
+	while ((node = (profiler_fg_node *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		node->name = get_func_name(node->fn_oid);
 
-				if (finalize_profile)
-				{
-					pstmt->us_total -= *nested_us_total;
-
-					/*
-					 * the max time can be calculated only when this node
-					 * was executed once!
-					 */
-					if (pstmt->exec_count == 1)
-						pstmt->us_max = pstmt->us_total;
-					else
-						pstmt->us_max = 0;
-
-					*nested_us_total += pstmt->us_total;
-				}
-			}
-			break;
+		/* the function was dropped */
+		if (!node->name)
+			node->name = psprintf("%u", node->fn_oid);
+	}
 
-		default:
-			if (finalize_profile)
-				*nested_us_total = pstmt->us_total;
-			break;
+	initStringInfo(&prefix);
+
+	hash_seq_init(&hash_seq, nodes);
+
+	while ((node = (profiler_fg_node *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (node->calls > 0 && node->root_calls > 0)
+			profiler_flamegraph_walk(ri,
+									 node,
+									 (double) node->root_calls / node->calls,
+									 0,
+									 &prefix);
 	}
+
+	pfree(prefix.data);
+	hash_destroy(nodes);
 }
 
 /*
- * clean all chunks used by profiler
+ * Prepare tuplestore with currently executed statements of profiled
+ * functions of all backends. Slots are read without locks, the slot
+ * is read again, when it was changed while reading.
+ *
+ * Like pg_stat_activity, the function of other backend is displayed
+ * only when current user has privileges of role of this backend, or
+ * when current user is member of pg_read_all_stats role.
  */
-Datum
-plpgsql_profiler_reset_all(PG_FUNCTION_ARGS)
+void
+plpgsql_check_profiler_show_activity(plpgsql_check_result_info *ri)
 {
-	if (shared_profiler_chunks_HashTable)
+	bool		read_all_stats;
+	int			i;
+
+	/* there are not slots, when shared memory is not used */
+	if (!profiler_backend_slots)
+		return;
+
+#if PG_VERSION_NUM >= 100000
+
+	read_all_stats = is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_ALL_STATS);
+
+#else
+
+	/* there is not pg_read_all_stats role, superuser has privileges of all roles */
+	read_all_stats = false;
+
+#endif
+
+	for (i = 0; i < profiler_nbackend_slots; i++)
 	{
-		HASH_SEQ_STATUS			hash_seq;
-		profiler_stmt_chunk    *chunk;
+		volatile profiler_backend_slot *slot = &profiler_backend_slots[i];
+		profiler_backend_slot copy;
 
-		LWLockAcquire(profiler_ss->lock, LW_EXCLUSIVE);
+		for (;;)
+		{
+			int			before_changecount;
+			int			after_changecount;
+
+			before_changecount = slot->changecount;
+			pg_read_barrier();
+
+			copy.pid = slot->pid;
+			copy.dbid = slot->dbid;
+			copy.roleid = slot->roleid;
+			copy.fn_oid = slot->fn_oid;
+			copy.lineno = slot->lineno;
+			copy.depth = slot->depth;
+
+			pg_read_barrier();
+			after_changecount = slot->changecount;
 
-		hash_seq_init(&hash_seq, shared_profiler_chunks_HashTable);
+			if (before_changecount == after_changecount &&
+				(before_changecount & 1) == 0)
+				break;
 
-		while ((chunk = hash_seq_search(&hash_seq)) != NULL)
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (copy.pid == 0 || !OidIsValid(copy.fn_oid))
+			continue;
+
+		/* the function is not displayed, but the backend is */
+		if (!read_all_stats && !has_privs_of_role(GetUserId(), copy.roleid))
 		{
-			hash_search(shared_profiler_chunks_HashTable, &(chunk->key), HASH_REMOVE, NULL);
+			plpgsql_check_put_profiler_activity(ri,
+												copy.pid,
+												copy.dbid,
+												InvalidOid,
+												0,
+												0);
+			continue;
 		}
 
-		LWLockRelease(profiler_ss->lock);
+		plpgsql_check_put_profiler_activity(ri,
+											copy.pid,
+											copy.dbid,
+											copy.fn_oid,
+											copy.lineno,
+											copy.depth);
 	}
-	else
-		plpgsql_check_profiler_init_hash_tables();
-
-	PG_RETURN_VOID();
 }
 
+
 /*
- * Clean chunks related to some function
+ * plpgsql plugin related functions
  */
-Datum
-plpgsql_profiler_reset(PG_FUNCTION_ARGS)
+
+/*
+ * Returns true, when this call of function should be profiled. When
+ * plpgsql_check.profiler_sample_rate is less than 1.0, then only random
+ * part of outermost calls is profiled. The nested calls inherit the
+ * decision (and sample rate) of outermost call, so the counters of
+ * called functions and the edges of call graph are scaled by same
+ * sample rate, and they can be compared.
+ */
+static bool
+profiler_call_is_sampled(double *sample_rate)
 {
-	Oid			funcoid = PG_GETARG_OID(0);
-	profiler_hashkey hk;
-	HTAB	   *chunks;
-	HeapTuple	procTuple;
-	bool		found;
-	bool		shared_chunks;
+	if (!dlist_is_empty(&profiler_active_frames))
+	{
+		profiler_info *head = dlist_container(profiler_info, node,
+											  dlist_head_node(&profiler_active_frames));
 
-	procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcoid));
-	if (!HeapTupleIsValid(procTuple))
-		elog(ERROR, "cache lookup failed for function %u", funcoid);
+		/* the sample rate of marker of not sampled call is zero */
+		*sample_rate = head->sample_rate;
 
-	/* ensure correct complete content of hash key */
-	memset(&hk, 0, sizeof(profiler_hashkey));
-	hk.fn_oid = funcoid;
-	hk.db_oid = MyDatabaseId;
-	hk.fn_xmin = HeapTupleHeaderGetRawXmin(procTuple->t_data);
-	hk.fn_tid =  procTuple->t_self;
-	hk.chunk_num = 1;
+		return head->sample_rate > 0.0;
+	}
 
-	ReleaseSysCache(procTuple);
+	*sample_rate = plpgsql_check_profiler_sample_rate;
 
-	if (shared_profiler_chunks_HashTable)
-	{
-		LWLockAcquire(profiler_ss->lock, LW_EXCLUSIVE);
-		chunks = shared_profiler_chunks_HashTable;
-		shared_chunks = true;
-	}
-	else
-	{
-		chunks = profiler_chunks_HashTable;
-		shared_chunks = false;
-	}
+	if (plpgsql_check_profiler_sample_rate >= 1.0)
+		return true;
 
-	for(;;)
-	{
-		hash_search(chunks, (void *) &hk, HASH_REMOVE, &found);
-		if (!found)
-			break;
-		hk.chunk_num += 1;
-	}
+	return random() < plpgsql_check_profiler_sample_rate * ((double) MAX_RANDOM_VALUE + 1);
+}
 
-	if (shared_chunks)
-		LWLockRelease(profiler_ss->lock);
+/*
+ * Returns id of statement executed by the call. The queries of
+ * declarations are attributed to entry statement.
+ */
+static int
+profiler_current_stmtid(profiler_info *pinfo)
+{
+	if (pinfo->current_stmtid >= 0)
+		return pinfo->current_stmtid;
 
-	PG_RETURN_VOID();
+	return profiler_get_stmtid(pinfo->profile, pinfo->profile->entry_stmt);
 }
 
+/*
+ * Clean slot of backend, when backend is finished
+ */
 static void
-update_persistent_profile(profiler_info *pinfo, PLpgSQL_function *func)
+profiler_backend_slot_clean(int code, Datum arg)
 {
-	profiler_profile *profile = pinfo->profile;
-	profiler_hashkey hk;
-	profiler_stmt_chunk *chunk;
-	profiler_stmt_chunk *first_chunk = NULL;
-	bool		found;
-	int			i;
-	int			stmt_counter = 0;
-	HTAB	   *chunks;
-	bool		shared_chunks;
-	bool		exclusive_lock = false;
-	volatile bool unlock_mutex = false;
+	volatile profiler_backend_slot *slot = profiler_my_slot;
 
-	if (shared_profiler_chunks_HashTable)
-	{
-		chunks = shared_profiler_chunks_HashTable;
-		LWLockAcquire(profiler_ss->lock, LW_SHARED);
-		shared_chunks = true;
-	}
-	else
-	{
-		chunks = profiler_chunks_HashTable;
-		shared_chunks = false;
-	}
+	profiler_slot_begin_write(slot);
 
-	profiler_init_hashkey(&hk, func);
+	slot->pid = 0;
+	slot->dbid = InvalidOid;
+	slot->roleid = InvalidOid;
+	slot->fn_oid = InvalidOid;
+	slot->lineno = 0;
+	slot->depth = 0;
 
-	/* don't need too strong lock for shared memory */
-	chunk = (profiler_stmt_chunk *) hash_search(chunks,
-											 (void *) &hk,
-											 HASH_FIND,
-											 &found);
+	profiler_slot_end_write(slot);
 
-	/* We need exclusive lock */
-	if (!found && shared_chunks)
-	{
-		LWLockRelease(profiler_ss->lock);
-		LWLockAcquire(profiler_ss->lock, LW_EXCLUSIVE);
-		exclusive_lock = true;
+	profiler_my_slot = NULL;
+}
 
-		chunk = (profiler_stmt_chunk *) hash_search(chunks,
-												 (void *) &hk,
-												 HASH_ENTER,
-												 &found);
-	}
+/*
+ * Returns frame of last active profiled call (markers of not profiled
+ * calls are skipped) or NULL.
+ */
+static profiler_info *
+profiler_nearest_profiled_frame(void)
+{
+	dlist_iter	iter;
 
-	if (!found)
+	dlist_foreach(iter, &profiler_active_frames)
 	{
-		int		i;
-		int		stmt_counter;
-
-		/* first shared chunk is prepared already. local chunk should be done */
-		if (shared_chunks)
-		{
-			/* for first chunk we need to initialize mutex */
-			SpinLockInit(&chunk->mutex);
-			stmt_counter = 0;
-		}
-		else
-			stmt_counter = -1;
+		profiler_info *pinfo = dlist_container(profiler_info, node, iter.cur);
 
-		/* we should to enter empty chunks first */
-		for (i = 0; i < profile->nstatements; i++)
-		{
-			profiler_stmt_reduced *prstmt;
-			profiler_stmt *pstmt = &pinfo->stmts[i];
+		if (pinfo->profile)
+			return pinfo;
+	}
 
-			hk.chunk_num = 0;
+	return NULL;
+}
 
-			if (stmt_counter == -1 || stmt_counter >= STATEMENTS_PER_CHUNK)
-			{
-				hk.chunk_num += 1;
+/*
+ * true, when the slot of this backend holds some published activity
+ */
+static bool profiler_activity_published = false;
 
-				chunk = (profiler_stmt_chunk *) hash_search(chunks,
-															 (void *) &hk,
-															 HASH_ENTER,
-															 &found);
+/*
+ * Publish currently executed statement of last profiled call to slot
+ * of backend. When there is not any active profiled call, or when
+ * the publishing of activity is disabled, then the function of slot
+ * is cleaned.
+ */
+static void
+profiler_publish_activity(void)
+{
+	volatile profiler_backend_slot *slot;
+	profiler_info *pinfo;
 
-				if (found)
-					elog(ERROR, "broken consistency of plpgsql_check profiler chunks");
+	if (!profiler_my_slot)
+	{
+		/* there are not slots, when shared memory is not used */
+		if (!profiler_backend_slots ||
+			MyBackendId == InvalidBackendId ||
+			MyBackendId > profiler_nbackend_slots)
+			return;
+
+		profiler_my_slot = &profiler_backend_slots[MyBackendId - 1];
+		on_shmem_exit(profiler_backend_slot_clean, (Datum) 0);
+	}
 
-				stmt_counter = 0;
-			}
+	slot = profiler_my_slot;
 
-			prstmt = &chunk->stmts[stmt_counter++];
+	profiler_slot_begin_write(slot);
 
-			prstmt->lineno = pstmt->lineno;
-			prstmt->us_max = pstmt->us_max;
-			prstmt->us_total = pstmt->us_total;
-			prstmt->rows = pstmt->rows;
-			prstmt->exec_count = pstmt->exec_count;
-		}
+	slot->pid = MyProcPid;
+	slot->dbid = MyDatabaseId;
+	slot->roleid = GetSessionUserId();
 
-		/* clean unused stmts in chunk */
-		while (stmt_counter < STATEMENTS_PER_CHUNK)
-			chunk->stmts[stmt_counter++].lineno = -1;
+	pinfo = plpgsql_check_profiler_activity ? profiler_nearest_profiled_frame() : NULL;
 
-		if (shared_chunks)
-			LWLockRelease(profiler_ss->lock);
+	if (pinfo)
+	{
+		profiler_profile *profile = pinfo->profile;
 
-		return;
+		slot->fn_oid = profile->key.fn_oid;
+		slot->lineno = profile->stmts_meta[profiler_current_stmtid(pinfo)].lineno;
+		slot->depth = pinfo->depth;
 	}
-
-	/* if we have not exclusive lock, we should to lock first chunk */
-	PG_TRY();
+	else
 	{
-		if (shared_chunks && !exclusive_lock)
-		{
-			first_chunk = chunk;
-			SpinLockAcquire(&first_chunk->mutex);
-			unlock_mutex = true;
-		}
+		slot->fn_oid = InvalidOid;
+		slot->lineno = 0;
+		slot->depth = 0;
+	}
 
-		/* there is a profiler chunk already */
-		for (i = 0; i < profile->nstatements; i++)
-		{
-			profiler_stmt_reduced *prstmt;
-			profiler_stmt *pstmt = &pinfo->stmts[i];
+	profiler_slot_end_write(slot);
 
-			if (stmt_counter >= STATEMENTS_PER_CHUNK)
-			{
-				hk.chunk_num += 1;
+	profiler_activity_published = pinfo != NULL;
+}
 
-				chunk = (profiler_stmt_chunk *) hash_search(chunks,
-															 (void *) &hk,
-															 HASH_FIND,
-															 &found);
+/*
+ * The activity is published only when it is enabled. When it was
+ * disabled inside call, then the slot should be cleaned once.
+ */
+static inline void
+profiler_update_activity(void)
+{
+	if (plpgsql_check_profiler_activity || profiler_activity_published)
+		profiler_publish_activity();
+}
 
-				if (!found)
-					elog(ERROR, "broken consistency of plpgsql_check profiler chunks");
+/*
+ * Registers statement executed first time in this call (only counters
+ * of registered statements are merged to persistent profile).
+ */
+static inline void
+profiler_mark_executed(profiler_info *pinfo, int stmtid)
+{
+	profiler_stmt *pstmt = &pinfo->stmts[stmtid];
 
-				stmt_counter = 0;
-			}
+	if (!pstmt->executed)
+	{
+		pstmt->executed = true;
+		pinfo->executed_stmtids[pinfo->nexecuted_stmtids++] = stmtid;
+	}
+}
 
-			prstmt = &chunk->stmts[stmt_counter++];
+/*
+ * Returns cold part of state of statement. It is allocated, when it is
+ * used first time in the frame, and it is reused with the frame.
+ */
+static inline profiler_stmt_ext *
+profiler_get_stmt_ext(profiler_info *pinfo, int stmtid)
+{
+	if (!pinfo->stmts_ext)
+		pinfo->stmts_ext = MemoryContextAllocZero(profiler_mcxt,
+												  pinfo->profile->nstatements * sizeof(profiler_stmt_ext));
 
-			if (prstmt->lineno != pstmt->lineno)
-				elog(ERROR, "broken consistency of plpgsql_check profiler chunks");
+	return &pinfo->stmts_ext[stmtid];
+}
 
-			if (prstmt->us_max < pstmt->us_max)
-				prstmt->us_max = pstmt->us_max;
+/*
+ * Returns frame for new call of function. The frame of some finished call
+ * is reused when it is possible. The counters of reused frame are zero
+ * already.
+ */
+static profiler_info *
+profiler_get_frame(profiler_profile *profile)
+{
+	profiler_info *pinfo;
 
-			prstmt->us_total += pstmt->us_total;
-			prstmt->rows += pstmt->rows;
-			prstmt->exec_count += pstmt->exec_count;
-		}
-	}
-	PG_CATCH();
+	if (!dlist_is_empty(&profile->free_frames))
 	{
-		if (unlock_mutex)
-			SpinLockRelease(&first_chunk->mutex);
-		PG_RE_THROW();
+		pinfo = dlist_container(profiler_info, node,
+								dlist_pop_head_node(&profile->free_frames));
+		profile->nfree_frames -= 1;
+
+		return pinfo;
 	}
-	PG_END_TRY();
 
-	if (unlock_mutex)
-		SpinLockRelease(&first_chunk->mutex);
+	pinfo = MemoryContextAllocZero(profiler_mcxt, sizeof(profiler_info));
+	pinfo->profile = profile;
+	pinfo->stmts = MemoryContextAllocZero(profiler_mcxt,
+										  profile->nstatements * sizeof(profiler_stmt));
+	pinfo->stmts_ext = NULL;
+	pinfo->executed_stmtids = MemoryContextAlloc(profiler_mcxt,
+												 profile->nstatements * sizeof(int));
+	pinfo->nexecuted_stmtids = 0;
 
-	if (shared_chunks)
-		LWLockRelease(profiler_ss->lock);
+	return pinfo;
 }
 
 /*
- * PLpgSQL statements has not unique id. We can assign some unique id
- * that can be used for statements counters. Fast access to this id
- * is implemented via map structure. It is a array of lists structure.
- *
- * From PostgreSQL 12 we can use stmtid, but still we need map table,
- * because native stmtid has different order against lineno. But with
- * native stmtid, a creating map and searching in map is much faster.
+ * Returns frame of finished call to free list of profile. Only counters
+ * of executed statements should be cleaned.
  */
 static void
-profiler_update_map(profiler_profile *profile, PLpgSQL_stmt *stmt)
+profiler_release_frame(profiler_info *pinfo)
 {
-#if PG_VERSION_NUM < 120000
+	profiler_profile *profile = pinfo->profile;
+	int			i;
 
-	int		lineno = stmt->lineno;
-	profiler_map_entry *pme;
+	dlist_delete(&pinfo->node);
 
-	if (lineno > profile->stmts_map_max_lineno)
+	/* the owner should not to release this frame again */
+	if (pinfo->owner)
 	{
-		int		lines;
-		int		i;
+		pinfo->owner->pinfo = NULL;
+		pinfo->owner = NULL;
+	}
 
-		/* calculate new size of map */
-		for (lines = profile->stmts_map_max_lineno; stmt->lineno < lines;)
-			if (lines < 10000)
-				lines *= 2;
-			else
-				lines += 10000;
+	/* marker of not profiled call */
+	if (!profile)
+	{
+		dlist_push_head(&profiler_free_markers, &pinfo->node);
+		return;
+	}
 
-		profile->stmts_map = realloc(profile->stmts_map,
-									 lines * sizeof(profiler_map_entry));
+	/* the caller is executed again */
+	profiler_update_activity();
+
+	if (profile->nfree_frames < PROFILER_MAX_FREE_FRAMES)
+	{
+		for (i = 0; i < pinfo->nexecuted_stmtids; i++)
+		{
+			int			stmtid = pinfo->executed_stmtids[i];
 
-		for (i = profile->stmts_map_max_lineno; i < lines; i++)
-			profile->stmts_map[i].stmt = NULL;
+			memset(&pinfo->stmts[stmtid], 0, sizeof(profiler_stmt));
 
-		profile->stmts_map_max_lineno = lines;
-	}
+			if (pinfo->stmts_ext)
+				memset(&pinfo->stmts_ext[stmtid], 0, sizeof(profiler_stmt_ext));
+		}
 
-	pme = &profile->stmts_map[lineno];
+		pinfo->nexecuted_stmtids = 0;
 
-	if (!pme->stmt)
-	{
-		pme->stmt = stmt;
-		pme->stmtid = profile->nstatements++;
+		dlist_push_head(&profile->free_frames, &pinfo->node);
+		profile->nfree_frames += 1;
 	}
 	else
 	{
-		profiler_map_entry *new_pme = palloc(sizeof(profiler_map_entry));
-
-		new_pme->stmt = stmt;
-		new_pme->stmtid = profile->nstatements++;
-		new_pme->next = NULL;
-
-		while (pme->next)
-			pme = pme->next;
-
-		pme->next = new_pme;
+		pfree(pinfo->stmts);
+		if (pinfo->stmts_ext)
+			pfree(pinfo->stmts_ext);
+		pfree(pinfo->executed_stmtids);
+		pfree(pinfo);
 	}
+}
 
-#else
-
-	profile->stmts_map[stmt->stmtid - 1] = profile->nstatements++;
+#if PG_VERSION_NUM >= 90500
 
-#endif
+static void
+profiler_frame_owner_callback(void *arg)
+{
+	profiler_frame_owner *owner = (profiler_frame_owner *) arg;
 
+	if (owner->pinfo)
+		profiler_release_frame(owner->pinfo);
 }
 
+#endif
+
 /*
- * Returns statement id assigned to plpgsql statement. Should be
- * fast, because lineno is usually unique.
+ * Assign frame to memory context of current call. Should be called before
+ * the frame is pushed to active frames (memory allocation can fail).
  */
-static int
-profiler_get_stmtid(profiler_profile *profile, PLpgSQL_stmt *stmt)
+static void
+profiler_set_frame_owner(profiler_info *pinfo)
 {
-#if PG_VERSION_NUM < 120000
 
-	int		lineno = stmt->lineno;
-	profiler_map_entry *pme;
-
-	if (lineno > profile->stmts_map_max_lineno)
-		elog(ERROR, "broken statement map - too high lineno");
-
-	pme = &profile->stmts_map[lineno];
+#if PG_VERSION_NUM >= 90500
 
-	/* pme->stmt should not be null */
-	if (!pme->stmt)
-		elog(ERROR, "broken statement map - broken format");
+	profiler_frame_owner *owner;
 
-	while (pme && pme->stmt != stmt)
-		pme = pme->next;
+	owner = palloc(sizeof(profiler_frame_owner));
+	owner->pinfo = pinfo;
+	owner->callback.func = profiler_frame_owner_callback;
+	owner->callback.arg = owner;
 
-	/* we should to find statement */
-	if (!pme)
-		elog(ERROR, "broken statement map - cannot to find statement");
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, &owner->callback);
 
-	return pme->stmtid;
+	pinfo->owner = owner;
 
 #else
 
-	return profile->stmts_map[stmt->stmtid - 1];
+	pinfo->owner = NULL;
 
 #endif
+
 }
 
+#if PG_VERSION_NUM < 90500
+
+/*
+ * Release frames of calls broken by an error. When subxid is
+ * InvalidSubTransactionId, then all active frames are released
+ * (at the end of top transaction). Used only when memory context
+ * callbacks are not available.
+ */
 static void
-profiler_touch_stmts(profiler_info *pinfo,
-					 List *stmts,
-					 PLpgSQL_stmt *parent_stmt,
-					 const char *parent_note,
-					 bool generate_map,
-					 bool finalize_profile,
-					 int64 *nested_us_total,
-					 profiler_iterator *pi)
+profiler_release_aborted_frames(SubTransactionId subxid)
 {
-	ListCell *lc;
-	int		  block_num = 1;
+	dlist_mutable_iter iter;
 
-	*nested_us_total = 0;
-	block_num = 1;
-
-	foreach(lc, stmts)
+	dlist_foreach_modify(iter, &profiler_active_frames)
 	{
-		int64		us_total = 0;
-
-		PLpgSQL_stmt *stmt = (PLpgSQL_stmt *) lfirst(lc);
-
-		profiler_touch_stmt(pinfo,
-							stmt,
-							parent_stmt,
-							parent_note,
-							block_num++,
-							generate_map,
-							finalize_profile,
-							&us_total,
-							pi);
+		profiler_info *pinfo = dlist_container(profiler_info, node, iter.cur);
 
-		if (finalize_profile)
-			*nested_us_total += us_total;
+		if (subxid == InvalidSubTransactionId || pinfo->subxid >= subxid)
+			profiler_release_frame(pinfo);
 	}
 }
 
+#endif
+
 /*
- * Prepare tuplestore with function profile
- *
+ * Try to search profile pattern for function. Creates profile pattern when
+ * it doesn't exists.
  */
 void
-plpgsql_check_profiler_show_profile_statements(plpgsql_check_result_info *ri,
-									plpgsql_check_info *cinfo)
+plpgsql_check_profiler_func_init(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 {
-	PLpgSQL_function *function = NULL;
-
-#if PG_VERSION_NUM >= 120000
-
-	LOCAL_FCINFO(fake_fcinfo, 0);
-
-#else
-
-	FunctionCallInfoData fake_fcinfo_data;
-	FunctionCallInfo fake_fcinfo = &fake_fcinfo_data;
+	double		sample_rate;
+	bool		sampled;
 
-#endif
-
-	FmgrInfo	flinfo;
-	TriggerData trigdata;
-	EventTriggerData etrigdata;
-	Trigger tg_trigger;
-	ReturnSetInfo rsinfo;
-	bool		fake_rtd;
-	profiler_profile *profile;
-	profiler_hashkey hk_function;
-	profiler_info pinfo;
-	profiler_stmt_chunk *first_chunk = NULL;
-	profiler_iterator		pi;
-	volatile bool		unlock_mutex = false;
-	bool		found_profile = false;
-	bool		shared_chunks;
+	/* fast path, there is nothing to do */
+	if (!plpgsql_check_profiler && dlist_is_empty(&profiler_active_frames))
+		return;
 
-	memset(&pi, 0, sizeof(profiler_iterator));
-	pi.key.fn_oid = cinfo->fn_oid;
-	pi.key.db_oid = MyDatabaseId;
-	pi.key.fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
-	pi.key.fn_tid =  cinfo->proctuple->t_self;
-	pi.key.chunk_num = 1;
-	pi.ri = ri;
+	sampled = profiler_call_is_sampled(&sample_rate);
 
-	/* try to find first chunk in shared (or local) memory */
-	if (shared_profiler_chunks_HashTable)
-	{
-		LWLockAcquire(profiler_ss->lock, LW_SHARED);
-		pi.chunks = shared_profiler_chunks_HashTable;
-		shared_chunks = true;
-	}
-	else
+	if (plpgsql_check_profiler &&
+		func->fn_oid != InvalidOid &&
+		sampled)
 	{
-		pi.chunks = profiler_chunks_HashTable;
-		shared_chunks = false;
-	}
+		profiler_info *pinfo;
+		profiler_profile *profile;
+		profiler_hashkey hk;
+		bool		found;
+		profiler_func_cache_entry *cache_entry = profiler_func_cache_slot(func);
 
-	pi.current_chunk = first_chunk = (profiler_stmt_chunk *) hash_search(pi.chunks,
-																		 (void *) &pi.key,
-																		 HASH_FIND,
-																		 NULL);
+		profile = profiler_func_cache_lookup(func);
 
-	PG_TRY();
-	{
-		if (shared_chunks && first_chunk)
+		if (profile)
+			found = true;
+		else
 		{
-			SpinLockAcquire(&first_chunk->mutex);
-			unlock_mutex = true;
-		}
-
-		plpgsql_check_setup_fcinfo(cinfo->proctuple,
-								   &flinfo,
-								   fake_fcinfo,
-								   &rsinfo,
-								   &trigdata,
-								   cinfo->relid,
-								   &etrigdata,
-								   cinfo->fn_oid,
-								   cinfo->rettype,
-								   cinfo->trigtype,
-								   &tg_trigger,
-								   &fake_rtd);
-
-		/* Get a compiled function */
-		function = plpgsql_compile(fake_fcinfo, false);
-
-		profiler_init_hashkey(&hk_function, function);
-		profile = (profiler_profile *) hash_search(profiler_HashTable,
-												 (void *) &hk_function,
+			profiler_init_hashkey(&hk, func);
+			profile = (profiler_profile *) hash_search(profiler_HashTable,
+												 (void *) &hk,
 												 HASH_ENTER,
-												 &found_profile);
-
-		pinfo.profile = profile;
+												 &found);
+		}
 
-		if (!found_profile)
+		if (!found)
 		{
 			MemoryContext oldcxt;
+			profiler_info init_pinfo;
+
+			init_pinfo.profile = profile;
 
 			oldcxt = MemoryContextSwitchTo(profiler_mcxt);
 
+			profile->nstatements = 0;
+
 #if PG_VERSION_NUM < 120000
 
-			profile->nstatements = 0;
-			profile->stmts_map_max_lineno = 200;
+			profile->stmts_map_size = PROFILER_MAP_INIT_SIZE;
 
-			profile->stmts_map = palloc0(profile->stmts_map_max_lineno * sizeof(profiler_map_entry));
+			profile->stmts_map = palloc0(profile->stmts_map_size * sizeof(profiler_map_entry));
 
 #else
 
-			profile->nstatements = function->nstatements;
-			profile->stmts_map = palloc0(function->nstatements * sizeof(int));
+			/* stmtid is index to stmts_map, the statements are numbered from zero */
+			profile->stmts_map = palloc0(func->nstatements * sizeof(int));
 
 #endif
 
-			profile->entry_stmt = (PLpgSQL_stmt *) function->action;
-			profiler_touch_stmt(&pinfo, (PLpgSQL_stmt *) function->action, NULL, NULL, 1, true, false, NULL, NULL);
+			profile->entry_stmt = (PLpgSQL_stmt *) func->action;
+			profile->stmts_meta = NULL;
+			profile->stmts_meta_size = 0;
+			profile->pending_stmts = NULL;
+			profile->pending_stmtids = NULL;
+			profile->npending_stmtids = 0;
+			profile->pending_calls = 0;
+			memset(&profile->pending_func_stats, 0, sizeof(profiler_func_stats));
+			dlist_init(&profile->free_frames);
+			profile->nfree_frames = 0;
+
+			profiler_touch_stmt(&init_pinfo, (PLpgSQL_stmt *) func->action, NULL, NULL, 1, true, NULL);
+
+			/* entry statements is not visible for plugin functions */
 
 			MemoryContextSwitchTo(oldcxt);
 		}
 
-		profiler_touch_stmt(&pinfo, (PLpgSQL_stmt *) function->action, NULL, NULL, 1, false, false, NULL, &pi);
+		cache_entry->func = func;
+		cache_entry->profile = profile;
+
+		pinfo = profiler_get_frame(profile);
+
+		pinfo->subxid = GetCurrentSubTransactionId();
+		profiler_set_frame_owner(pinfo);
+
+		if (!dlist_is_empty(&profiler_active_frames))
+			pinfo->depth = dlist_container(profiler_info, node,
+										   dlist_head_node(&profiler_active_frames))->depth + 1;
+		else
+			pinfo->depth = 1;
+
+		dlist_push_head(&profiler_active_frames, &pinfo->node);
+
+		pinfo->current_stmtid = -1;
+		pinfo->nested_calls_us = 0;
+		pinfo->sql_level = 0;
+
+		pinfo->sample_rate = sample_rate;
+		pinfo->timing = plpgsql_check_profiler_timing;
+		pinfo->buffers = plpgsql_check_profiler_buffers;
+		pinfo->use_tsc = pinfo->timing &&
+						 plpgsql_check_profiler_timer == PLPGSQL_CHECK_PROFILER_TIMER_TSC;
+
+		if (pinfo->use_tsc)
+		{
+			if (profiler_tsc_ticks_per_us == 0.0)
+				profiler_tsc_calibrate();
+
+			pinfo->start_ticks = profiler_read_tsc();
+		}
+		else if (pinfo->timing)
+			INSTR_TIME_SET_CURRENT(pinfo->start_time);
+
+		estate->plugin_info = pinfo;
 
+		profiler_update_activity();
 	}
-	PG_CATCH();
+	else
 	{
-		if (unlock_mutex)
-			SpinLockRelease(&first_chunk->mutex);
-		PG_RE_THROW();
-	}
-	PG_END_TRY();
+		profiler_info *marker;
+
+		/*
+		 * Not profiled call nested in profiled call, or not sampled outermost
+		 * call. The marker holds sampling decision for nested calls.
+		 */
+		if (!dlist_is_empty(&profiler_free_markers))
+			marker = dlist_container(profiler_info, node,
+									 dlist_pop_head_node(&profiler_free_markers));
+		else
+			marker = MemoryContextAllocZero(profiler_mcxt, sizeof(profiler_info));
 
-	if (unlock_mutex)
-		SpinLockRelease(&first_chunk->mutex);
+		marker->profile = NULL;
+		marker->subxid = GetCurrentSubTransactionId();
+		marker->sample_rate = sampled ? sample_rate : 0.0;
+		profiler_set_frame_owner(marker);
+
+		if (!dlist_is_empty(&profiler_active_frames))
+			marker->depth = dlist_container(profiler_info, node,
+											dlist_head_node(&profiler_active_frames))->depth;
+		else
+			marker->depth = 0;
+
+		dlist_push_head(&profiler_active_frames, &marker->node);
 
-	if (shared_chunks)
-		LWLockRelease(profiler_ss->lock);
+		estate->plugin_info = marker;
+	}
 }
 
-/*
- * Prepare tuplestore with function profile
- *
- */
 void
-plpgsql_check_profiler_show_profile(plpgsql_check_result_info *ri,
-									plpgsql_check_info *cinfo)
+plpgsql_check_profiler_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 {
-	profiler_hashkey hk;
-	bool found;
-	int			lineno = 1;
-	int			current_statement = 0;
-	profiler_stmt_chunk *chunk = NULL;
-	profiler_stmt_chunk *first_chunk = NULL;
-	HTAB	   *chunks;
-	bool		shared_chunks;
-	volatile bool		unlock_mutex = false;
-	char	   *prosrc = cinfo->src;
+	profiler_info *pinfo = (profiler_info *) estate->plugin_info;
 
-	/* ensure correct complete content of hash key */
-	memset(&hk, 0, sizeof(profiler_hashkey));
-	hk.fn_oid = cinfo->fn_oid;
-	hk.db_oid = MyDatabaseId;
-	hk.fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
-	hk.fn_tid =  cinfo->proctuple->t_self;
-	hk.chunk_num = 1;
-
-	/* try to find first chunk in shared (or local) memory */
-	if (shared_profiler_chunks_HashTable)
-	{
-		LWLockAcquire(profiler_ss->lock, LW_SHARED);
-		chunks = shared_profiler_chunks_HashTable;
-		shared_chunks = true;
-	}
-	else
+	/* marker of not profiled call */
+	if (pinfo && !pinfo->profile)
 	{
-		chunks = profiler_chunks_HashTable;
-		shared_chunks = false;
+		profiler_release_frame(pinfo);
+		estate->plugin_info = NULL;
+		return;
 	}
 
-	chunk = (profiler_stmt_chunk *) hash_search(chunks,
-											 (void *) &hk,
-											 HASH_FIND,
-											 &found);
-
-	PG_TRY();
+	/*
+	 * The frame should be released, although the profiler was disabled
+	 * inside the call.
+	 */
+	if (pinfo)
 	{
-		if (shared_chunks && chunk)
+		profiler_profile *profile = pinfo->profile;
+		int		entry_stmtid = profiler_get_stmtid(profile, profile->entry_stmt);
+		profiler_stmt *entry_pstmt = &pinfo->stmts[entry_stmtid];
+		bool			set_entry_stmt = entry_pstmt->exec_count == 0;
+		instr_time		now;
+		uint64			elapsed = 0;
+		profiler_func_stats func_stats;
+		bool			batching;
+
+		/* the time of call is used as time of entry statement */
+		if (pinfo->use_tsc)
 		{
-			first_chunk = chunk;
-			SpinLockAcquire(&first_chunk->mutex);
-			unlock_mutex = true;
-		}
+			uint64		ticks = profiler_read_tsc() - pinfo->start_ticks;
 
-		/* iterate over source code rows */
-		while (*prosrc)
-		{
-			char	   *lineend = prosrc;
-			char	   *linebeg = prosrc;
-			int			stmt_lineno = -1;
-			int64		us_total = 0;
-			int64		exec_count = 0;
-			Datum		max_time_array = (Datum) 0;
-			Datum		processed_rows_array = (Datum) 0;
-			int			cmds_on_row = 0;
-
-			/* find lineend */
-			while (*lineend != '\0' && *lineend != '\n')
-				lineend += 1;
-
-			if (*lineend == '\n')
+			elapsed = profiler_ticks_to_us(ticks);
+
+			if (set_entry_stmt)
 			{
-				*lineend = '\0';
-				prosrc = lineend + 1;
+				uint64		own_ticks;
+				uint64		self_ticks;
+
+				own_ticks = profiler_stmt_own_time(entry_pstmt, ticks);
+				self_ticks = ticks > entry_pstmt->nested_time ? ticks - entry_pstmt->nested_time : 0;
+
+				entry_pstmt->timer.tsc.ticks_total = own_ticks;
+				entry_pstmt->timer.tsc.ticks_max = own_ticks;
+				entry_pstmt->timer.tsc.self_ticks_total = self_ticks;
+				entry_pstmt->timer.tsc.self_ticks_max = self_ticks;
 			}
-			else
-				prosrc = lineend;
+		}
+		else if (pinfo->timing)
+		{
+			instr_time		end_time;
 
-			if (chunk)
-			{
-				/* skip invisible statements if any */
-				while (chunk->stmts[current_statement].lineno < lineno)
-				{
-					current_statement += 1;
+			INSTR_TIME_SET_CURRENT(end_time);
+			now = end_time;
+			INSTR_TIME_SUBTRACT(end_time, pinfo->start_time);
 
-					if (current_statement >= STATEMENTS_PER_CHUNK)
-					{
-						hk.chunk_num += 1;
+			elapsed = INSTR_TIME_GET_MICROSEC(end_time);
+
+			if (set_entry_stmt)
+			{
+				uint64		own_us;
+				uint64		self_us;
 
-						chunk = (profiler_stmt_chunk *) hash_search(chunks,
-														 (void *) &hk,
-														 HASH_FIND,
-														 &found);
+				own_us = profiler_stmt_own_time(entry_pstmt, elapsed);
+				self_us = elapsed > entry_pstmt->nested_time ? elapsed - entry_pstmt->nested_time : 0;
 
-						if (!found)
-						{
-							chunk = NULL;
-							break;
-						}
+				entry_pstmt->timer.clock.us_total = own_us;
+				entry_pstmt->timer.clock.us_max = own_us;
+				entry_pstmt->timer.clock.us_self_total = self_us;
+				entry_pstmt->timer.clock.us_self_max = self_us;
+			}
+		}
 
-						current_statement = 0;
-					}
-				}
+		/* without clock timer, the time is required only for flush interval */
+		if (!pinfo->timing || pinfo->use_tsc)
+		{
+			if (plpgsql_check_profiler_flush_interval > 0)
+				INSTR_TIME_SET_CURRENT(now);
+			else
+				INSTR_TIME_SET_ZERO(now);
+		}
 
-				if (chunk && chunk->stmts[current_statement].lineno == lineno)
-				{
-					ArrayBuildState *max_time_abs = NULL;
-					ArrayBuildState *processed_rows_abs = NULL;
+		if (set_entry_stmt)
+		{
+			entry_pstmt->exec_count = 1;
 
-#if PG_VERSION_NUM >= 90500
+			if (pinfo->timing)
+				profiler_get_stmt_ext(pinfo, entry_stmtid)->histogram[profiler_histogram_bucket(elapsed)] += 1;
 
-					max_time_abs = initArrayResult(FLOAT8OID, CurrentMemoryContext, true);
-					processed_rows_abs = initArrayResult(INT8OID, CurrentMemoryContext, true);
+			profiler_mark_executed(pinfo, entry_stmtid);
+		}
 
-#endif
+		profiler_func_stats_init_call(&func_stats, elapsed, pinfo->timing, pinfo->sample_rate);
 
-					stmt_lineno = lineno;
+		batching = shared_profiler_profiles_HashTable &&
+				   (plpgsql_check_profiler_flush_calls > 0 ||
+					plpgsql_check_profiler_flush_interval > 0);
 
-					/* try to collect all statements on the line */
-					while (chunk->stmts[current_statement].lineno == lineno)
-					{
-						profiler_stmt_reduced *prstmt;
+		/*
+		 * The caller is previous frame on stack. When the caller was not
+		 * profiled (the frame is marker), then the edge is not stored, and
+		 * the time of call is self time of caller's caller.
+		 */
+		if (dlist_has_next(&profiler_active_frames, &pinfo->node))
+		{
+			profiler_info *caller = dlist_container(profiler_info, node,
+													dlist_next_node(&profiler_active_frames,
+																	&pinfo->node));
 
-						if (current_statement >= STATEMENTS_PER_CHUNK)
-						{
-							hk.chunk_num += 1;
+			if (caller->profile)
+				profiler_update_call_edge(pinfo, caller, elapsed, batching);
+		}
 
-							chunk = (profiler_stmt_chunk *) hash_search(chunks,
-															 (void *) &hk,
-															 HASH_FIND,
-															 &found);
+		/*
+		 * The counters of call are accumulated in session memory. Without
+		 * batching, they are merged to shared memory immediately. Elsewhere
+		 * they are flushed after some number of calls or after some time.
+		 */
+		if (batching)
+		{
+			if (!profiler_exit_callback_registered)
+			{
+				before_shmem_exit(profiler_exit_callback, (Datum) 0);
+				profiler_exit_callback_registered = true;
+			}
 
-							if (!found)
-							{
-								chunk = NULL;
-								break;
-							}
+			if (profiler_pending_calls == 0)
+				profiler_last_flush = now;
 
-							current_statement = 0;
-						}
+			profiler_accumulate_pending(profile, pinfo, &func_stats);
 
-						if (!chunk)
-							break;
+			if (plpgsql_check_profiler_flush_calls > 0 &&
+				profiler_pending_calls >= plpgsql_check_profiler_flush_calls)
+				profiler_flush_pending();
+			else if (plpgsql_check_profiler_flush_interval > 0)
+			{
+				INSTR_TIME_SUBTRACT(now, profiler_last_flush);
 
-						prstmt = &chunk->stmts[current_statement];
+				if (INSTR_TIME_GET_MILLISEC(now) >= plpgsql_check_profiler_flush_interval)
+					profiler_flush_pending();
+			}
+		}
+		else
+		{
+			profiler_accumulate_pending(profile, pinfo, &func_stats);
+			profiler_flush_profile(profile);
+		}
 
-						us_total += prstmt->us_total;
-						exec_count += prstmt->exec_count;
+		profiler_release_frame(pinfo);
+		estate->plugin_info = NULL;
+	}
+}
 
-						cmds_on_row += 1;
+void
+plpgsql_check_profiler_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
+{
+	profiler_info *pinfo = (profiler_info *) estate->plugin_info;
 
-						max_time_abs = accumArrayResult(max_time_abs,
-														Float8GetDatum(prstmt->us_max / 1000.0), false,
-														FLOAT8OID,
-														CurrentMemoryContext);
+	/* there is nothing to do for not profiled calls (and markers) */
+	if (pinfo && pinfo->profile)
+	{
+		profiler_profile *profile = pinfo->profile;
+		int stmtid = profiler_get_stmtid(profile, stmt);
+		profiler_stmt *pstmt;
 
-						processed_rows_abs = accumArrayResult(processed_rows_abs,
-															 Int64GetDatum(prstmt->rows), false,
-															 INT8OID,
-															 CurrentMemoryContext);
+		/* the statement is caller of nested functions */
+		pinfo->current_stmtid = stmtid;
 
-						current_statement += 1;
-					}
+		profiler_update_activity();
 
-					max_time_array = makeArrayResult(max_time_abs, CurrentMemoryContext);
-					processed_rows_array = makeArrayResult(processed_rows_abs, CurrentMemoryContext);
-				}
-			}
+		if (pinfo->buffers)
+		{
+			profiler_stmt_ext *pext = profiler_get_stmt_ext(pinfo, stmtid);
 
-			plpgsql_check_put_profile(ri,
-								   lineno,
-								   stmt_lineno,
-								   cmds_on_row,
-								   exec_count,
-								   us_total,
-								   max_time_array,
-								   processed_rows_array,
-								   linebeg);
-
-			lineno += 1;
+			pext->start_shared_blks_hit = pgBufferUsage.shared_blks_hit;
+			pext->start_shared_blks_read = pgBufferUsage.shared_blks_read;
+			pext->start_shared_blks_dirtied = pgBufferUsage.shared_blks_dirtied;
+			pext->start_temp_blks_written = pgBufferUsage.temp_blks_written;
 		}
-	}
-	PG_CATCH();
-	{
-		if (unlock_mutex)
-			SpinLockRelease(&first_chunk->mutex);
-		PG_RE_THROW();
-	}
-	PG_END_TRY();
 
-	if (unlock_mutex)
-		SpinLockRelease(&first_chunk->mutex);
+		/* there is nothing to do, when only counters are collected */
+		if (!pinfo->timing)
+			return;
 
-	if (shared_chunks)
-		LWLockRelease(profiler_ss->lock);
-}
+		pstmt = &pinfo->stmts[stmtid];
 
+		pstmt->nested_time = 0;
+		pstmt->nested_calls_time = 0;
 
-/*
- * plpgsql plugin related functions
- */
+		if (pinfo->use_tsc)
+			pstmt->timer.tsc.start_ticks = profiler_read_tsc();
+		else
+			INSTR_TIME_SET_CURRENT(pstmt->timer.clock.start_time);
+	}
+}
 
-/*
- * Try to search profile pattern for function. Creates profile pattern when
- * it doesn't exists.
- */
 void
-plpgsql_check_profiler_func_init(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+plpgsql_check_profiler_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 {
-	if (plpgsql_check_profiler && func->fn_oid != InvalidOid)
+	profiler_info *pinfo = (profiler_info *) estate->plugin_info;
+
+	if (pinfo && pinfo->profile)
 	{
-		profiler_info *pinfo;
-		profiler_profile *profile;
-		profiler_hashkey hk;
-		bool		found;
+		profiler_profile *profile  = pinfo->profile;
+		int stmtid = profiler_get_stmtid(profile, stmt);
+		profiler_stmt *pstmt = &pinfo->stmts[stmtid];
+		profiler_stmt_meta *meta = &profile->stmts_meta[stmtid];
+		int parent_stmtid = meta->parent_stmtid;
 
-		profiler_init_hashkey(&hk, func);
-		profile = (profiler_profile *) hash_search(profiler_HashTable,
-											 (void *) &hk,
-											 HASH_ENTER,
-											 &found);
+		/* expressions of outer statement can call functions too */
+		pinfo->current_stmtid = parent_stmtid;
 
-		pinfo = palloc0(sizeof(profiler_info));
-		pinfo->profile = profile;
+		/* the plan of statement is prepared after first execution */
+		if (!meta->queryid_known)
+			profiler_update_stmt_queryid(meta, stmt);
 
-		if (!found)
+		if (pinfo->use_tsc)
 		{
-			MemoryContext oldcxt;
+			uint64		ticks = profiler_read_tsc() - pstmt->timer.tsc.start_ticks;
+			uint64		own_ticks = profiler_stmt_own_time(pstmt, ticks);
+			uint64		self_ticks;
 
-			oldcxt = MemoryContextSwitchTo(profiler_mcxt);
+			if (own_ticks > pstmt->timer.tsc.ticks_max)
+				pstmt->timer.tsc.ticks_max = own_ticks;
 
-#if PG_VERSION_NUM < 120000
+			pstmt->timer.tsc.ticks_total += own_ticks;
 
-			profile->nstatements = 0;
-			profile->stmts_map_max_lineno = 200;
+			self_ticks = ticks > pstmt->nested_time ? ticks - pstmt->nested_time : 0;
 
-			profile->stmts_map = palloc0(profile->stmts_map_max_lineno * sizeof(profiler_map_entry));
+			if (self_ticks > pstmt->timer.tsc.self_ticks_max)
+				pstmt->timer.tsc.self_ticks_max = self_ticks;
 
-#else
+			pstmt->timer.tsc.self_ticks_total += self_ticks;
 
-			profile->nstatements = func->nstatements;
-			profile->stmts_map = palloc0(func->nstatements * sizeof(int));
+			if (parent_stmtid >= 0)
+				pinfo->stmts[parent_stmtid].nested_time += ticks;
 
-#endif
+			profiler_get_stmt_ext(pinfo, stmtid)->histogram[profiler_histogram_bucket_ticks(own_ticks)] += 1;
+		}
+		else if (pinfo->timing)
+		{
+			instr_time		end_time;
+			uint64			elapsed;
+			uint64			own_us;
+			uint64			self_us;
 
-			profile->entry_stmt = (PLpgSQL_stmt *) func->action;
-			profiler_touch_stmt(pinfo, (PLpgSQL_stmt *) func->action, NULL, NULL, 1, true, false, NULL, NULL);
+			INSTR_TIME_SET_CURRENT(end_time);
+			INSTR_TIME_SUBTRACT(end_time, pstmt->timer.clock.start_time);
+			elapsed = INSTR_TIME_GET_MICROSEC(end_time);
 
-			/* entry statements is not visible for plugin functions */
+			own_us = profiler_stmt_own_time(pstmt, elapsed);
 
-			MemoryContextSwitchTo(oldcxt);
+			if (own_us > pstmt->timer.clock.us_max)
+				pstmt->timer.clock.us_max = own_us;
+
+			pstmt->timer.clock.us_total += own_us;
+
+			self_us = elapsed > pstmt->nested_time ? elapsed - pstmt->nested_time : 0;
+
+			if (self_us > pstmt->timer.clock.us_self_max)
+				pstmt->timer.clock.us_self_max = self_us;
+
+			pstmt->timer.clock.us_self_total += self_us;
+
+			if (parent_stmtid >= 0)
+				pinfo->stmts[parent_stmtid].nested_time += elapsed;
+
+			profiler_get_stmt_ext(pinfo, stmtid)->histogram[profiler_histogram_bucket(own_us)] += 1;
 		}
 
-		pinfo->stmts = palloc0(profile->nstatements * sizeof(profiler_stmt));
+		/* buffer usage of statement is inclusive */
+		if (pinfo->buffers)
+		{
+			profiler_stmt_ext *pext = profiler_get_stmt_ext(pinfo, stmtid);
+
+			pext->shared_blks_hit += pgBufferUsage.shared_blks_hit -
+									 pext->start_shared_blks_hit;
+			pext->shared_blks_read += pgBufferUsage.shared_blks_read -
+									  pext->start_shared_blks_read;
+			pext->shared_blks_dirtied += pgBufferUsage.shared_blks_dirtied -
+										 pext->start_shared_blks_dirtied;
+			pext->temp_blks_written += pgBufferUsage.temp_blks_written -
+									   pext->start_temp_blks_written;
+		}
 
-		INSTR_TIME_SET_CURRENT(pinfo->start_time);
+		pstmt->rows += estate->eval_processed;
 
-		estate->plugin_info = pinfo;
+		pstmt->exec_count += 1;
+		profiler_mark_executed(pinfo, stmtid);
 	}
 }
 
-void
-plpgsql_check_profiler_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+/*
+ * Planner and executor hooks
+ *
+ * When plpgsql_check.profiler_sql_timing is on, then the time of planning
+ * and the time of execution of queries are attributed to the executed
+ * statement of the last profiled call. Only outer query is measured, the
+ * time of nested queries (executed without nested profiled call) is part
+ * of time of outer query. The time of nested profiled calls is subtracted,
+ * so planning and execution time are parts of self time of statement.
+ *
+ * The hooks are global - they are called for all queries of backend, when
+ * plpgsql_check is loaded. So the caller should to check the GUC first,
+ * and this function is called only when sql timing is on.
+ */
+static profiler_info *
+profiler_sql_timing_frame(int *stmtid)
 {
-	if (plpgsql_check_profiler &&
-		estate->plugin_info &&
-		func->fn_oid != InvalidOid)
-	{
-		profiler_info *pinfo = (profiler_info *) estate->plugin_info;
-		profiler_profile *profile = pinfo->profile;
-		int		entry_stmtid = profiler_get_stmtid(profile, profile->entry_stmt);
-		instr_time		end_time;
-		uint64			elapsed;
-		int64			nested_us_total;
+	profiler_info *pinfo;
 
-		INSTR_TIME_SET_CURRENT(end_time);
-		INSTR_TIME_SUBTRACT(end_time, pinfo->start_time);
+	if (dlist_is_empty(&profiler_active_frames))
+		return NULL;
 
-		elapsed = INSTR_TIME_GET_MICROSEC(end_time);
+	pinfo = dlist_container(profiler_info, node,
+							dlist_head_node(&profiler_active_frames));
 
-		if (pinfo->stmts[entry_stmtid].exec_count == 0)
-		{
-			pinfo->stmts[entry_stmtid].exec_count = 1;
-			pinfo->stmts[entry_stmtid].us_total = elapsed;
-			pinfo->stmts[entry_stmtid].us_max = elapsed;
-		}
+	/* queries of not profiled call are not measured */
+	if (!pinfo->profile || !pinfo->timing || pinfo->sql_level > 0)
+		return NULL;
 
-		/* finalize profile - get result profile */
-		profiler_touch_stmt(pinfo,
-						   profile->entry_stmt,
-						   NULL,
-						   NULL,
-						   1,
-						   false,
-						   true,
-						   &nested_us_total,
-						   NULL);
+	*stmtid = profiler_current_stmtid(pinfo);
 
-		update_persistent_profile(pinfo, func);
+	return pinfo;
+}
 
-		pfree(pinfo->stmts);
-		pfree(pinfo);
-	}
+/*
+ * Returns time from start_time without time of nested profiled calls,
+ * so the planning and execution time are comparable with self time
+ * of statement.
+ */
+static uint64
+profiler_elapsed_us(instr_time start_time, uint64 nested_calls_us)
+{
+	instr_time	end_time;
+	uint64		elapsed;
+
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_SUBTRACT(end_time, start_time);
+
+	elapsed = INSTR_TIME_GET_MICROSEC(end_time);
+
+	return elapsed > nested_calls_us ? elapsed - nested_calls_us : 0;
 }
 
-void
-plpgsql_check_profiler_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
+PlannedStmt *
+plpgsql_check_profiler_planner(Query *parse,
+							   int cursorOptions,
+							   ParamListInfo boundParams)
 {
-	if (plpgsql_check_profiler &&
-		estate->plugin_info &&
-		estate->func->fn_oid != InvalidOid)
+	profiler_info *pinfo;
+	PlannedStmt *result;
+	instr_time	start_time;
+	uint64		nested_calls_us;
+	int			stmtid;
+
+	/* fast path, when sql timing is off */
+	pinfo = plpgsql_check_profiler_sql_timing ? profiler_sql_timing_frame(&stmtid) : NULL;
+
+	if (!pinfo)
 	{
-		profiler_info *pinfo = (profiler_info *) estate->plugin_info;
-		profiler_profile *profile = pinfo->profile;
-		int stmtid = profiler_get_stmtid(profile, stmt);
-		profiler_stmt *pstmt = &pinfo->stmts[stmtid];
+		if (prev_planner_hook)
+			return prev_planner_hook(parse, cursorOptions, boundParams);
+
+		return standard_planner(parse, cursorOptions, boundParams);
+	}
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	nested_calls_us = pinfo->nested_calls_us;
+	pinfo->sql_level += 1;
 
-		INSTR_TIME_SET_CURRENT(pstmt->start_time);
+	PG_TRY();
+	{
+		if (prev_planner_hook)
+			result = prev_planner_hook(parse, cursorOptions, boundParams);
+		else
+			result = standard_planner(parse, cursorOptions, boundParams);
+	}
+	PG_CATCH();
+	{
+		pinfo->sql_level -= 1;
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+
+	pinfo->sql_level -= 1;
+
+	profiler_get_stmt_ext(pinfo, stmtid)->us_plan_total +=
+		profiler_elapsed_us(start_time, pinfo->nested_calls_us - nested_calls_us);
+	profiler_mark_executed(pinfo, stmtid);
+
+	return result;
 }
 
+#if PG_VERSION_NUM >= 100000
+
+#define PROFILER_EXECUTOR_RUN(hook, queryDesc, direction, count, execute_once) \
+	hook(queryDesc, direction, count, execute_once)
+
 void
-plpgsql_check_profiler_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
+plpgsql_check_profiler_ExecutorRun(QueryDesc *queryDesc,
+								   ScanDirection direction,
+								   uint64 count,
+								   bool execute_once)
+
+#elif PG_VERSION_NUM >= 90600
+
+#define PROFILER_EXECUTOR_RUN(hook, queryDesc, direction, count, execute_once) \
+	hook(queryDesc, direction, count)
+
+void
+plpgsql_check_profiler_ExecutorRun(QueryDesc *queryDesc,
+								   ScanDirection direction,
+								   uint64 count)
+
+#else
+
+#define PROFILER_EXECUTOR_RUN(hook, queryDesc, direction, count, execute_once) \
+	hook(queryDesc, direction, count)
+
+void
+plpgsql_check_profiler_ExecutorRun(QueryDesc *queryDesc,
+								   ScanDirection direction,
+								   long count)
+
+#endif
+
 {
-	if (plpgsql_check_profiler && 
-		estate->plugin_info && 
-		estate->func->fn_oid != InvalidOid)
-	{
-		profiler_info *pinfo = (profiler_info *) estate->plugin_info;
-		profiler_profile *profile  = pinfo->profile;
-		int stmtid = profiler_get_stmtid(profile, stmt);
-		profiler_stmt *pstmt = &pinfo->stmts[stmtid];
-		instr_time		end_time;
-		uint64			elapsed;
-		instr_time		end_time2;
+	profiler_info *pinfo;
+	instr_time	start_time;
+	uint64		nested_calls_us;
+	int			stmtid;
 
-		INSTR_TIME_SET_CURRENT(end_time);
-		end_time2 = end_time;
-		INSTR_TIME_ACCUM_DIFF(pstmt->total, end_time, pstmt->start_time);
+	/* fast path, when sql timing is off */
+	pinfo = plpgsql_check_profiler_sql_timing ? profiler_sql_timing_frame(&stmtid) : NULL;
 
-		INSTR_TIME_SUBTRACT(end_time2, pstmt->start_time);
-		elapsed = INSTR_TIME_GET_MICROSEC(end_time2);
+	if (!pinfo)
+	{
+		if (prev_ExecutorRun_hook)
+			PROFILER_EXECUTOR_RUN(prev_ExecutorRun_hook, queryDesc, direction, count, execute_once);
+		else
+			PROFILER_EXECUTOR_RUN(standard_ExecutorRun, queryDesc, direction, count, execute_once);
+
+		return;
+	}
 
-		if (elapsed > pstmt->us_max)
-			pstmt->us_max = elapsed;
+	INSTR_TIME_SET_CURRENT(start_time);
+	nested_calls_us = pinfo->nested_calls_us;
+	pinfo->sql_level += 1;
 
-		pstmt->us_total = INSTR_TIME_GET_MICROSEC(pstmt->total);
-		pstmt->rows += estate->eval_processed;
-		pstmt->exec_count++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun_hook)
+			PROFILER_EXECUTOR_RUN(prev_ExecutorRun_hook, queryDesc, direction, count, execute_once);
+		else
+			PROFILER_EXECUTOR_RUN(standard_ExecutorRun, queryDesc, direction, count, execute_once);
+	}
+	PG_CATCH();
+	{
+		pinfo->sql_level -= 1;
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+
+	pinfo->sql_level -= 1;
+
+	profiler_get_stmt_ext(pinfo, stmtid)->us_exec_total +=
+		profiler_elapsed_us(start_time, pinfo->nested_calls_us - nested_calls_us);
+	profiler_mark_executed(pinfo, stmtid);
 }
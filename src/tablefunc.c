@@ -23,6 +23,11 @@ PG_FUNCTION_INFO_V1(plpgsql_check_function_tb);
 PG_FUNCTION_INFO_V1(plpgsql_show_dependency_tb);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_function_tb);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_function_statements_tb);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_functions_all_tb);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_top_statements_tb);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_call_graph_tb);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_flamegraph_tb);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_activity_tb);
 
 /*
  * Validate function result description
@@ -310,3 +315,151 @@ plpgsql_profiler_function_statements_tb(PG_FUNCTION_ARGS)
 	return (Datum) 0;
 }
 
+/*
+ * Displaying statistics of calls of all profiled functions
+ */
+Datum
+plpgsql_profiler_functions_all_tb(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_FUNCTIONS_ALL_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_show_functions_all(&ri);
+
+	plpgsql_check_finalize_ri(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displaying top statements of all profiled functions
+ */
+Datum
+plpgsql_profiler_top_statements_tb(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+	int			n;
+	int			order_by;
+	char	   *order_by_str;
+
+	if (PG_NARGS() != 2)
+		elog(ERROR, "unexpected number of parameters, you should to update extension");
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	n = PG_GETARG_INT32(0);
+	order_by_str = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	if (strcmp(order_by_str, "total_time") == 0)
+		order_by = PLPGSQL_CHECK_PROFILER_ORDER_BY_TOTAL_TIME;
+	else if (strcmp(order_by_str, "max_time") == 0)
+		order_by = PLPGSQL_CHECK_PROFILER_ORDER_BY_MAX_TIME;
+	else if (strcmp(order_by_str, "exec_count") == 0)
+		order_by = PLPGSQL_CHECK_PROFILER_ORDER_BY_EXEC_COUNT;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognize order: \"%s\"", order_by_str),
+				 errhint("Only \"total_time\", \"max_time\" and \"exec_count\" are supported.")));
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_TOP_STATEMENTS_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_show_top_statements(&ri, n, order_by);
+
+	plpgsql_check_finalize_ri(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displaying edges of call graph of profiled functions
+ */
+Datum
+plpgsql_profiler_call_graph_tb(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_CALL_GRAPH_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_show_call_graph(&ri);
+
+	plpgsql_check_finalize_ri(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displaying flame graph of profiled functions in collapsed stack format
+ */
+Datum
+plpgsql_profiler_flamegraph_tb(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+	char	   *counter_str;
+	bool		use_time;
+
+	if (PG_NARGS() != 1)
+		elog(ERROR, "unexpected number of parameters, you should to update extension");
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	counter_str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+	if (strcmp(counter_str, "time") == 0)
+		use_time = true;
+	else if (strcmp(counter_str, "exec_count") == 0)
+		use_time = false;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognize counter: \"%s\"", counter_str),
+				 errhint("Only \"time\" and \"exec_count\" are supported.")));
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_FLAMEGRAPH_TEXT, rsinfo);
+
+	plpgsql_check_profiler_show_flamegraph(&ri, use_time);
+
+	plpgsql_check_finalize_ri(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displaying currently executed statements of profiled functions
+ * of all backends
+ */
+Datum
+plpgsql_profiler_activity_tb(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_ACTIVITY_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_show_activity(&ri);
+
+	plpgsql_check_finalize_ri(&ri);
+
+	return (Datum) 0;
+}